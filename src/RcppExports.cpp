@@ -19,8 +19,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // cor_phylo_cpp
-List cor_phylo_cpp(const arma::mat& X, const std::vector<arma::mat>& U, const arma::mat& M, const arma::mat& Vphy_, const bool& REML, const bool& constrain_d, const double& lower_d, const bool& verbose, const double& rcond_threshold, const double& rel_tol, const int& max_iter, const std::string& method, const bool& no_corr, const uint_fast32_t& boot, const std::string& keep_boots, const std::vector<double>& sann);
-RcppExport SEXP _phyr_cor_phylo_cpp(SEXP XSEXP, SEXP USEXP, SEXP MSEXP, SEXP Vphy_SEXP, SEXP REMLSEXP, SEXP constrain_dSEXP, SEXP lower_dSEXP, SEXP verboseSEXP, SEXP rcond_thresholdSEXP, SEXP rel_tolSEXP, SEXP max_iterSEXP, SEXP methodSEXP, SEXP no_corrSEXP, SEXP bootSEXP, SEXP keep_bootsSEXP, SEXP sannSEXP) {
+List cor_phylo_cpp(const arma::mat& X, const std::vector<arma::mat>& U, const arma::mat& M, const arma::mat& Vphy_, const bool& REML, const bool& constrain_d, const double& lower_d, const bool& verbose, const double& rcond_threshold, const double& rel_tol, const int& max_iter, const std::string& method, const bool& no_corr, const uint_fast32_t& boot, const std::string& keep_boots, const std::vector<double>& sann, const std::vector<std::string>& retry_methods, const uint_fast32_t& retry_restarts, const double& max_time);
+RcppExport SEXP _phyr_cor_phylo_cpp(SEXP XSEXP, SEXP USEXP, SEXP MSEXP, SEXP Vphy_SEXP, SEXP REMLSEXP, SEXP constrain_dSEXP, SEXP lower_dSEXP, SEXP verboseSEXP, SEXP rcond_thresholdSEXP, SEXP rel_tolSEXP, SEXP max_iterSEXP, SEXP methodSEXP, SEXP no_corrSEXP, SEXP bootSEXP, SEXP keep_bootsSEXP, SEXP sannSEXP, SEXP retry_methodsSEXP, SEXP retry_restartsSEXP, SEXP max_timeSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -40,7 +40,31 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const uint_fast32_t& >::type boot(bootSEXP);
     Rcpp::traits::input_parameter< const std::string& >::type keep_boots(keep_bootsSEXP);
     Rcpp::traits::input_parameter< const std::vector<double>& >::type sann(sannSEXP);
-    rcpp_result_gen = Rcpp::wrap(cor_phylo_cpp(X, U, M, Vphy_, REML, constrain_d, lower_d, verbose, rcond_threshold, rel_tol, max_iter, method, no_corr, boot, keep_boots, sann));
+    Rcpp::traits::input_parameter< const std::vector<std::string>& >::type retry_methods(retry_methodsSEXP);
+    Rcpp::traits::input_parameter< const uint_fast32_t& >::type retry_restarts(retry_restartsSEXP);
+    Rcpp::traits::input_parameter< const double& >::type max_time(max_timeSEXP);
+    rcpp_result_gen = Rcpp::wrap(cor_phylo_cpp(X, U, M, Vphy_, REML, constrain_d, lower_d, verbose, rcond_threshold, rel_tol, max_iter, method, no_corr, boot, keep_boots, sann, retry_methods, retry_restarts, max_time));
+    return rcpp_result_gen;
+END_RCPP
+}
+// cor_phylo_scan_cpp
+List cor_phylo_scan_cpp(const arma::mat& X, const arma::mat& U, const arma::mat& Vphy_, const bool& REML, const double& lower_d, const double& upper_d, const uint_fast32_t& n_grid, const double& rel_tol, const int& max_iter, const uint_fast32_t& batch_size, const uint_fast32_t& n_threads);
+RcppExport SEXP _phyr_cor_phylo_scan_cpp(SEXP XSEXP, SEXP USEXP, SEXP Vphy_SEXP, SEXP REMLSEXP, SEXP lower_dSEXP, SEXP upper_dSEXP, SEXP n_gridSEXP, SEXP rel_tolSEXP, SEXP max_iterSEXP, SEXP batch_sizeSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type U(USEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type Vphy_(Vphy_SEXP);
+    Rcpp::traits::input_parameter< const bool& >::type REML(REMLSEXP);
+    Rcpp::traits::input_parameter< const double& >::type lower_d(lower_dSEXP);
+    Rcpp::traits::input_parameter< const double& >::type upper_d(upper_dSEXP);
+    Rcpp::traits::input_parameter< const uint_fast32_t& >::type n_grid(n_gridSEXP);
+    Rcpp::traits::input_parameter< const double& >::type rel_tol(rel_tolSEXP);
+    Rcpp::traits::input_parameter< const int& >::type max_iter(max_iterSEXP);
+    Rcpp::traits::input_parameter< const uint_fast32_t& >::type batch_size(batch_sizeSEXP);
+    Rcpp::traits::input_parameter< const uint_fast32_t& >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(cor_phylo_scan_cpp(X, U, Vphy_, REML, lower_d, upper_d, n_grid, rel_tol, max_iter, batch_size, n_threads));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -142,9 +166,34 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// pglmm_profile_LRT_cpp
+List pglmm_profile_LRT_cpp(NumericVector par, const arma::vec& H, const arma::mat& X, const arma::sp_mat& Zt, const arma::sp_mat& St, const arma::vec& mu, const List& nested, bool REML, const std::string family, arma::vec totalSize, bool reoptimize, std::string optimizer, int maxit, double reltol, int n_threads);
+RcppExport SEXP _phyr_pglmm_profile_LRT_cpp(SEXP parSEXP, SEXP HSEXP, SEXP XSEXP, SEXP ZtSEXP, SEXP StSEXP, SEXP muSEXP, SEXP nestedSEXP, SEXP REMLSEXP, SEXP familySEXP, SEXP totalSizeSEXP, SEXP reoptimizeSEXP, SEXP optimizerSEXP, SEXP maxitSEXP, SEXP reltolSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type H(HSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type Zt(ZtSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type St(StSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type mu(muSEXP);
+    Rcpp::traits::input_parameter< const List& >::type nested(nestedSEXP);
+    Rcpp::traits::input_parameter< bool >::type REML(REMLSEXP);
+    Rcpp::traits::input_parameter< const std::string >::type family(familySEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type totalSize(totalSizeSEXP);
+    Rcpp::traits::input_parameter< bool >::type reoptimize(reoptimizeSEXP);
+    Rcpp::traits::input_parameter< std::string >::type optimizer(optimizerSEXP);
+    Rcpp::traits::input_parameter< int >::type maxit(maxitSEXP);
+    Rcpp::traits::input_parameter< double >::type reltol(reltolSEXP);
+    Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_profile_LRT_cpp(par, H, X, Zt, St, mu, nested, REML, family, totalSize, reoptimize, optimizer, maxit, reltol, n_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
 // pglmm_internal_cpp
-List pglmm_internal_cpp(const arma::mat& X, const arma::vec& Y, const arma::sp_mat& Zt, const arma::sp_mat& St, const List& nested, const bool REML, const bool verbose, const int n, const int p, const int q, const int maxit, const double reltol, const double tol_pql, const double maxit_pql, const std::string optimizer, arma::mat B_init, arma::vec ss, const std::string family, arma::vec totalSize);
-RcppExport SEXP _phyr_pglmm_internal_cpp(SEXP XSEXP, SEXP YSEXP, SEXP ZtSEXP, SEXP StSEXP, SEXP nestedSEXP, SEXP REMLSEXP, SEXP verboseSEXP, SEXP nSEXP, SEXP pSEXP, SEXP qSEXP, SEXP maxitSEXP, SEXP reltolSEXP, SEXP tol_pqlSEXP, SEXP maxit_pqlSEXP, SEXP optimizerSEXP, SEXP B_initSEXP, SEXP ssSEXP, SEXP familySEXP, SEXP totalSizeSEXP) {
+List pglmm_internal_cpp(const arma::mat& X, const arma::vec& Y, const arma::sp_mat& Zt, const arma::sp_mat& St, const List& nested, const bool REML, const bool verbose, const int n, const int p, const int q, const int maxit, const double reltol, const double tol_pql, const double maxit_pql, const std::string optimizer, arma::mat B_init, arma::vec ss, const std::string family, arma::vec totalSize, const int n_threads);
+RcppExport SEXP _phyr_pglmm_internal_cpp(SEXP XSEXP, SEXP YSEXP, SEXP ZtSEXP, SEXP StSEXP, SEXP nestedSEXP, SEXP REMLSEXP, SEXP verboseSEXP, SEXP nSEXP, SEXP pSEXP, SEXP qSEXP, SEXP maxitSEXP, SEXP reltolSEXP, SEXP tol_pqlSEXP, SEXP maxit_pqlSEXP, SEXP optimizerSEXP, SEXP B_initSEXP, SEXP ssSEXP, SEXP familySEXP, SEXP totalSizeSEXP, SEXP n_threadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -167,7 +216,8 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< arma::vec >::type ss(ssSEXP);
     Rcpp::traits::input_parameter< const std::string >::type family(familySEXP);
     Rcpp::traits::input_parameter< arma::vec >::type totalSize(totalSizeSEXP);
-    rcpp_result_gen = Rcpp::wrap(pglmm_internal_cpp(X, Y, Zt, St, nested, REML, verbose, n, p, q, maxit, reltol, tol_pql, maxit_pql, optimizer, B_init, ss, family, totalSize));
+    Rcpp::traits::input_parameter< const int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_internal_cpp(X, Y, Zt, St, nested, REML, verbose, n, p, q, maxit, reltol, tol_pql, maxit_pql, optimizer, B_init, ss, family, totalSize, n_threads));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -182,6 +232,101 @@ BEGIN_RCPP
     return rcpp_result_gen;
 END_RCPP
 }
+// pglmm_bootstrap_cpp
+List pglmm_bootstrap_cpp(const arma::mat& X, const arma::vec& Y, const arma::sp_mat& Zt, const arma::sp_mat& St, const List& nested, const bool REML, const std::string family, arma::vec totalSize, const arma::vec& B, const arma::vec& ss, const std::string optimizer, const int maxit, const double reltol, const double tol_pql, const double maxit_pql, const int nboot, const int n_threads);
+RcppExport SEXP _phyr_pglmm_bootstrap_cpp(SEXP XSEXP, SEXP YSEXP, SEXP ZtSEXP, SEXP StSEXP, SEXP nestedSEXP, SEXP REMLSEXP, SEXP familySEXP, SEXP totalSizeSEXP, SEXP BSEXP, SEXP ssSEXP, SEXP optimizerSEXP, SEXP maxitSEXP, SEXP reltolSEXP, SEXP tol_pqlSEXP, SEXP maxit_pqlSEXP, SEXP nbootSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type Zt(ZtSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type St(StSEXP);
+    Rcpp::traits::input_parameter< const List& >::type nested(nestedSEXP);
+    Rcpp::traits::input_parameter< const bool >::type REML(REMLSEXP);
+    Rcpp::traits::input_parameter< const std::string >::type family(familySEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type totalSize(totalSizeSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type B(BSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type ss(ssSEXP);
+    Rcpp::traits::input_parameter< const std::string >::type optimizer(optimizerSEXP);
+    Rcpp::traits::input_parameter< const int >::type maxit(maxitSEXP);
+    Rcpp::traits::input_parameter< const double >::type reltol(reltolSEXP);
+    Rcpp::traits::input_parameter< const double >::type tol_pql(tol_pqlSEXP);
+    Rcpp::traits::input_parameter< const double >::type maxit_pql(maxit_pqlSEXP);
+    Rcpp::traits::input_parameter< const int >::type nboot(nbootSEXP);
+    Rcpp::traits::input_parameter< const int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_bootstrap_cpp(X, Y, Zt, St, nested, REML, family, totalSize, B, ss, optimizer, maxit, reltol, tol_pql, maxit_pql, nboot, n_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_simulate_cpp
+arma::mat pglmm_simulate_cpp(const arma::mat& X, const arma::sp_mat& Zt, const arma::sp_mat& St, const List& nested, const std::string family, arma::vec totalSize, const arma::vec& B, const arma::vec& ss, const arma::vec& eta, const int nsim, const int n_threads);
+RcppExport SEXP _phyr_pglmm_simulate_cpp(SEXP XSEXP, SEXP ZtSEXP, SEXP StSEXP, SEXP nestedSEXP, SEXP familySEXP, SEXP totalSizeSEXP, SEXP BSEXP, SEXP ssSEXP, SEXP etaSEXP, SEXP nsimSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type Zt(ZtSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type St(StSEXP);
+    Rcpp::traits::input_parameter< const List& >::type nested(nestedSEXP);
+    Rcpp::traits::input_parameter< const std::string >::type family(familySEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type totalSize(totalSizeSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type B(BSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type ss(ssSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type eta(etaSEXP);
+    Rcpp::traits::input_parameter< const int >::type nsim(nsimSEXP);
+    Rcpp::traits::input_parameter< const int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_simulate_cpp(X, Zt, St, nested, family, totalSize, B, ss, eta, nsim, n_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_nested_cpp
+arma::sp_mat pglmm_nested_cpp(const IntegerVector& g1, const IntegerVector& g2, const arma::mat& cov1, const arma::mat& cov2, const arma::vec& x);
+RcppExport SEXP _phyr_pglmm_nested_cpp(SEXP g1SEXP, SEXP g2SEXP, SEXP cov1SEXP, SEXP cov2SEXP, SEXP xSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const IntegerVector& >::type g1(g1SEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type g2(g2SEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type cov1(cov1SEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type cov2(cov2SEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type x(xSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_nested_cpp(g1, g2, cov1, cov2, x));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_Zt_cpp
+arma::sp_mat pglmm_Zt_cpp(const IntegerVector& g, const arma::mat& R, const arma::vec& x);
+RcppExport SEXP _phyr_pglmm_Zt_cpp(SEXP gSEXP, SEXP RSEXP, SEXP xSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const IntegerVector& >::type g(gSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type R(RSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type x(xSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_Zt_cpp(g, R, x));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_cross_cov_times
+arma::vec pglmm_cross_cov_times(const IntegerVector& g1_new, const IntegerVector& g2_new, const IntegerVector& g1_obs, const IntegerVector& g2_obs, const arma::mat& cov1, const arma::mat& cov2, const arma::vec& x_new, const arma::vec& x_obs, const arma::vec& w);
+RcppExport SEXP _phyr_pglmm_cross_cov_times(SEXP g1_newSEXP, SEXP g2_newSEXP, SEXP g1_obsSEXP, SEXP g2_obsSEXP, SEXP cov1SEXP, SEXP cov2SEXP, SEXP x_newSEXP, SEXP x_obsSEXP, SEXP wSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const IntegerVector& >::type g1_new(g1_newSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type g2_new(g2_newSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type g1_obs(g1_obsSEXP);
+    Rcpp::traits::input_parameter< const IntegerVector& >::type g2_obs(g2_obsSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type cov1(cov1SEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type cov2(cov2SEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type x_new(x_newSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type x_obs(x_obsSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type w(wSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_cross_cov_times(g1_new, g2_new, g1_obs, g2_obs, cov1, cov2, x_new, x_obs, w));
+    return rcpp_result_gen;
+END_RCPP
+}
 // pglmm_gaussian_predict
 arma::vec pglmm_gaussian_predict(const arma::mat& iV, const arma::mat& H);
 RcppExport SEXP _phyr_pglmm_gaussian_predict(SEXP iVSEXP, SEXP HSEXP) {
@@ -230,8 +375,8 @@ BEGIN_RCPP
 END_RCPP
 }
 // pglmm_gaussian_internal_cpp
-Rcpp::List pglmm_gaussian_internal_cpp(NumericVector par, const arma::mat& X, const arma::vec& Y, const arma::sp_mat& Zt, const arma::sp_mat& St, const List& nested, bool REML, bool verbose, std::string optimizer, int maxit, double reltol, int q, int n, int p, const double Pi);
-RcppExport SEXP _phyr_pglmm_gaussian_internal_cpp(SEXP parSEXP, SEXP XSEXP, SEXP YSEXP, SEXP ZtSEXP, SEXP StSEXP, SEXP nestedSEXP, SEXP REMLSEXP, SEXP verboseSEXP, SEXP optimizerSEXP, SEXP maxitSEXP, SEXP reltolSEXP, SEXP qSEXP, SEXP nSEXP, SEXP pSEXP, SEXP PiSEXP) {
+Rcpp::List pglmm_gaussian_internal_cpp(NumericVector par, const arma::mat& X, const arma::vec& Y, const arma::sp_mat& Zt, const arma::sp_mat& St, const List& nested, bool REML, bool verbose, std::string optimizer, int maxit, double reltol, int q, int n, int p, const double Pi, const List& iterative, int n_threads);
+RcppExport SEXP _phyr_pglmm_gaussian_internal_cpp(SEXP parSEXP, SEXP XSEXP, SEXP YSEXP, SEXP ZtSEXP, SEXP StSEXP, SEXP nestedSEXP, SEXP REMLSEXP, SEXP verboseSEXP, SEXP optimizerSEXP, SEXP maxitSEXP, SEXP reltolSEXP, SEXP qSEXP, SEXP nSEXP, SEXP pSEXP, SEXP PiSEXP, SEXP iterativeSEXP, SEXP n_threadsSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -250,7 +395,246 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< int >::type n(nSEXP);
     Rcpp::traits::input_parameter< int >::type p(pSEXP);
     Rcpp::traits::input_parameter< const double >::type Pi(PiSEXP);
-    rcpp_result_gen = Rcpp::wrap(pglmm_gaussian_internal_cpp(par, X, Y, Zt, St, nested, REML, verbose, optimizer, maxit, reltol, q, n, p, Pi));
+    Rcpp::traits::input_parameter< const List& >::type iterative(iterativeSEXP);
+    Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_gaussian_internal_cpp(par, X, Y, Zt, St, nested, REML, verbose, optimizer, maxit, reltol, q, n, p, Pi, iterative, n_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_gaussian_multi_cpp
+Rcpp::List pglmm_gaussian_multi_cpp(NumericVector par, const arma::mat& X, const arma::mat& Y, const arma::sp_mat& Zt, const arma::sp_mat& St, const List& nested, bool REML, std::string optimizer, int maxit, double reltol, int q, int n, int p, const double Pi, int n_threads);
+RcppExport SEXP _phyr_pglmm_gaussian_multi_cpp(SEXP parSEXP, SEXP XSEXP, SEXP YSEXP, SEXP ZtSEXP, SEXP StSEXP, SEXP nestedSEXP, SEXP REMLSEXP, SEXP optimizerSEXP, SEXP maxitSEXP, SEXP reltolSEXP, SEXP qSEXP, SEXP nSEXP, SEXP pSEXP, SEXP PiSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type Zt(ZtSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type St(StSEXP);
+    Rcpp::traits::input_parameter< const List& >::type nested(nestedSEXP);
+    Rcpp::traits::input_parameter< bool >::type REML(REMLSEXP);
+    Rcpp::traits::input_parameter< std::string >::type optimizer(optimizerSEXP);
+    Rcpp::traits::input_parameter< int >::type maxit(maxitSEXP);
+    Rcpp::traits::input_parameter< double >::type reltol(reltolSEXP);
+    Rcpp::traits::input_parameter< int >::type q(qSEXP);
+    Rcpp::traits::input_parameter< int >::type n(nSEXP);
+    Rcpp::traits::input_parameter< int >::type p(pSEXP);
+    Rcpp::traits::input_parameter< const double >::type Pi(PiSEXP);
+    Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_gaussian_multi_cpp(par, X, Y, Zt, St, nested, REML, optimizer, maxit, reltol, q, n, p, Pi, n_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_mcmc_cpp
+List pglmm_mcmc_cpp(const arma::mat& X, const arma::vec& Y, const arma::sp_mat& Zt, const arma::sp_mat& St, const List& nested, const std::string family, const arma::vec& totalSize, const arma::vec& B0, const arma::vec& s2_0, const int samples, const int burnin, const int thin, const int chains, const int n_threads);
+RcppExport SEXP _phyr_pglmm_mcmc_cpp(SEXP XSEXP, SEXP YSEXP, SEXP ZtSEXP, SEXP StSEXP, SEXP nestedSEXP, SEXP familySEXP, SEXP totalSizeSEXP, SEXP B0SEXP, SEXP s2_0SEXP, SEXP samplesSEXP, SEXP burninSEXP, SEXP thinSEXP, SEXP chainsSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type Zt(ZtSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type St(StSEXP);
+    Rcpp::traits::input_parameter< const List& >::type nested(nestedSEXP);
+    Rcpp::traits::input_parameter< const std::string >::type family(familySEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type totalSize(totalSizeSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type B0(B0SEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type s2_0(s2_0SEXP);
+    Rcpp::traits::input_parameter< const int >::type samples(samplesSEXP);
+    Rcpp::traits::input_parameter< const int >::type burnin(burninSEXP);
+    Rcpp::traits::input_parameter< const int >::type thin(thinSEXP);
+    Rcpp::traits::input_parameter< const int >::type chains(chainsSEXP);
+    Rcpp::traits::input_parameter< const int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_mcmc_cpp(X, Y, Zt, St, nested, family, totalSize, B0, s2_0, samples, burnin, thin, chains, n_threads));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_cpp
+SEXP pglmm_model_cpp(const arma::mat& X, const arma::vec& Y, const arma::sp_mat& Zt, const arma::sp_mat& St, const List& nested, bool REML, const std::string family, arma::vec totalSize, const arma::vec& mu, const arma::vec& H);
+RcppExport SEXP _phyr_pglmm_model_cpp(SEXP XSEXP, SEXP YSEXP, SEXP ZtSEXP, SEXP StSEXP, SEXP nestedSEXP, SEXP REMLSEXP, SEXP familySEXP, SEXP totalSizeSEXP, SEXP muSEXP, SEXP HSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< const arma::mat& >::type X(XSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type Y(YSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type Zt(ZtSEXP);
+    Rcpp::traits::input_parameter< const arma::sp_mat& >::type St(StSEXP);
+    Rcpp::traits::input_parameter< const List& >::type nested(nestedSEXP);
+    Rcpp::traits::input_parameter< bool >::type REML(REMLSEXP);
+    Rcpp::traits::input_parameter< const std::string >::type family(familySEXP);
+    Rcpp::traits::input_parameter< arma::vec >::type totalSize(totalSizeSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type mu(muSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type H(HSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_cpp(X, Y, Zt, St, nested, REML, family, totalSize, mu, H));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_update
+void pglmm_model_update(SEXP xptr, const arma::vec& mu, const arma::vec& H);
+RcppExport SEXP _phyr_pglmm_model_update(SEXP xptrSEXP, SEXP muSEXP, SEXP HSEXP) {
+BEGIN_RCPP
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type mu(muSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type H(HSEXP);
+    pglmm_model_update(xptr, mu, H);
+    return R_NilValue;
+END_RCPP
+}
+// pglmm_model_LL
+double pglmm_model_LL(NumericVector par, SEXP xptr, bool verbose);
+RcppExport SEXP _phyr_pglmm_model_LL(SEXP parSEXP, SEXP xptrSEXP, SEXP verboseSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    Rcpp::traits::input_parameter< bool >::type verbose(verboseSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_LL(par, xptr, verbose));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_gaussian_calc
+List pglmm_model_gaussian_calc(NumericVector par, SEXP xptr);
+RcppExport SEXP _phyr_pglmm_model_gaussian_calc(SEXP parSEXP, SEXP xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_gaussian_calc(par, xptr));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_iV_logdetV
+List pglmm_model_iV_logdetV(NumericVector par, SEXP xptr, bool logdet);
+RcppExport SEXP _phyr_pglmm_model_iV_logdetV(SEXP parSEXP, SEXP xptrSEXP, SEXP logdetSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    Rcpp::traits::input_parameter< bool >::type logdet(logdetSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_iV_logdetV(par, xptr, logdet));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_V
+arma::sp_mat pglmm_model_V(NumericVector par, SEXP xptr, bool missing_mu);
+RcppExport SEXP _phyr_pglmm_model_V(SEXP parSEXP, SEXP xptrSEXP, SEXP missing_muSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    Rcpp::traits::input_parameter< bool >::type missing_mu(missing_muSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_V(par, xptr, missing_mu));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_iV_times
+arma::mat pglmm_model_iV_times(NumericVector par, SEXP xptr, const arma::mat& B);
+RcppExport SEXP _phyr_pglmm_model_iV_times(SEXP parSEXP, SEXP xptrSEXP, SEXP BSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type B(BSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_iV_times(par, xptr, B));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_iV_diag
+arma::vec pglmm_model_iV_diag(NumericVector par, SEXP xptr);
+RcppExport SEXP _phyr_pglmm_model_iV_diag(SEXP parSEXP, SEXP xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_iV_diag(par, xptr));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_logdetV
+double pglmm_model_logdetV(NumericVector par, SEXP xptr);
+RcppExport SEXP _phyr_pglmm_model_logdetV(SEXP parSEXP, SEXP xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_logdetV(par, xptr));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_V_times
+arma::mat pglmm_model_V_times(NumericVector par, SEXP xptr, const arma::mat& B);
+RcppExport SEXP _phyr_pglmm_model_V_times(SEXP parSEXP, SEXP xptrSEXP, SEXP BSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    Rcpp::traits::input_parameter< const arma::mat& >::type B(BSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_V_times(par, xptr, B));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_iV_dense
+arma::mat pglmm_model_iV_dense(NumericVector par, SEXP xptr);
+RcppExport SEXP _phyr_pglmm_model_iV_dense(SEXP parSEXP, SEXP xptrSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_iV_dense(par, xptr));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_gaussian_nearest
+arma::vec pglmm_model_gaussian_nearest(NumericVector par, SEXP xptr, const arma::vec& R);
+RcppExport SEXP _phyr_pglmm_model_gaussian_nearest(SEXP parSEXP, SEXP xptrSEXP, SEXP RSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type R(RSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_gaussian_nearest(par, xptr, R));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_gaussian_predict
+arma::vec pglmm_model_gaussian_predict(NumericVector par, SEXP xptr, const arma::vec& H);
+RcppExport SEXP _phyr_pglmm_model_gaussian_predict(SEXP parSEXP, SEXP xptrSEXP, SEXP HSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    Rcpp::traits::input_parameter< const arma::vec& >::type H(HSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_gaussian_predict(par, xptr, H));
+    return rcpp_result_gen;
+END_RCPP
+}
+// pglmm_model_profile_LRT
+List pglmm_model_profile_LRT(NumericVector par, SEXP xptr, bool reoptimize, std::string optimizer, int maxit, double reltol, int n_threads);
+RcppExport SEXP _phyr_pglmm_model_profile_LRT(SEXP parSEXP, SEXP xptrSEXP, SEXP reoptimizeSEXP, SEXP optimizerSEXP, SEXP maxitSEXP, SEXP reltolSEXP, SEXP n_threadsSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< NumericVector >::type par(parSEXP);
+    Rcpp::traits::input_parameter< SEXP >::type xptr(xptrSEXP);
+    Rcpp::traits::input_parameter< bool >::type reoptimize(reoptimizeSEXP);
+    Rcpp::traits::input_parameter< std::string >::type optimizer(optimizerSEXP);
+    Rcpp::traits::input_parameter< int >::type maxit(maxitSEXP);
+    Rcpp::traits::input_parameter< double >::type reltol(reltolSEXP);
+    Rcpp::traits::input_parameter< int >::type n_threads(n_threadsSEXP);
+    rcpp_result_gen = Rcpp::wrap(pglmm_model_profile_LRT(par, xptr, reoptimize, optimizer, maxit, reltol, n_threads));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -320,19 +704,42 @@ END_RCPP
 
 static const R_CallMethodDef CallEntries[] = {
     {"_phyr_cor_phylo_LL", (DL_FUNC) &_phyr_cor_phylo_LL, 2},
-    {"_phyr_cor_phylo_cpp", (DL_FUNC) &_phyr_cor_phylo_cpp, 16},
+    {"_phyr_cor_phylo_cpp", (DL_FUNC) &_phyr_cor_phylo_cpp, 19},
+    {"_phyr_cor_phylo_scan_cpp", (DL_FUNC) &_phyr_cor_phylo_scan_cpp, 11},
     {"_phyr_set_seed", (DL_FUNC) &_phyr_set_seed, 1},
     {"_phyr_predict_cpp", (DL_FUNC) &_phyr_predict_cpp, 4},
     {"_phyr_pcd2_loop", (DL_FUNC) &_phyr_pcd2_loop, 7},
     {"_phyr_pglmm_iV_logdetV_cpp", (DL_FUNC) &_phyr_pglmm_iV_logdetV_cpp, 8},
     {"_phyr_pglmm_V", (DL_FUNC) &_phyr_pglmm_V, 8},
     {"_phyr_pglmm_LL_cpp", (DL_FUNC) &_phyr_pglmm_LL_cpp, 11},
-    {"_phyr_pglmm_internal_cpp", (DL_FUNC) &_phyr_pglmm_internal_cpp, 19},
+    {"_phyr_pglmm_profile_LRT_cpp", (DL_FUNC) &_phyr_pglmm_profile_LRT_cpp, 15},
+    {"_phyr_pglmm_internal_cpp", (DL_FUNC) &_phyr_pglmm_internal_cpp, 20},
     {"_phyr_sexp_type", (DL_FUNC) &_phyr_sexp_type, 1},
+    {"_phyr_pglmm_bootstrap_cpp", (DL_FUNC) &_phyr_pglmm_bootstrap_cpp, 17},
+    {"_phyr_pglmm_simulate_cpp", (DL_FUNC) &_phyr_pglmm_simulate_cpp, 11},
+    {"_phyr_pglmm_nested_cpp", (DL_FUNC) &_phyr_pglmm_nested_cpp, 5},
+    {"_phyr_pglmm_Zt_cpp", (DL_FUNC) &_phyr_pglmm_Zt_cpp, 3},
+    {"_phyr_pglmm_cross_cov_times", (DL_FUNC) &_phyr_pglmm_cross_cov_times, 9},
     {"_phyr_pglmm_gaussian_predict", (DL_FUNC) &_phyr_pglmm_gaussian_predict, 2},
     {"_phyr_pglmm_gaussian_LL_cpp", (DL_FUNC) &_phyr_pglmm_gaussian_LL_cpp, 8},
     {"_phyr_pglmm_gaussian_LL_calc_cpp", (DL_FUNC) &_phyr_pglmm_gaussian_LL_calc_cpp, 7},
-    {"_phyr_pglmm_gaussian_internal_cpp", (DL_FUNC) &_phyr_pglmm_gaussian_internal_cpp, 15},
+    {"_phyr_pglmm_gaussian_internal_cpp", (DL_FUNC) &_phyr_pglmm_gaussian_internal_cpp, 17},
+    {"_phyr_pglmm_gaussian_multi_cpp", (DL_FUNC) &_phyr_pglmm_gaussian_multi_cpp, 15},
+    {"_phyr_pglmm_mcmc_cpp", (DL_FUNC) &_phyr_pglmm_mcmc_cpp, 14},
+    {"_phyr_pglmm_model_cpp", (DL_FUNC) &_phyr_pglmm_model_cpp, 10},
+    {"_phyr_pglmm_model_update", (DL_FUNC) &_phyr_pglmm_model_update, 3},
+    {"_phyr_pglmm_model_LL", (DL_FUNC) &_phyr_pglmm_model_LL, 3},
+    {"_phyr_pglmm_model_gaussian_calc", (DL_FUNC) &_phyr_pglmm_model_gaussian_calc, 2},
+    {"_phyr_pglmm_model_iV_logdetV", (DL_FUNC) &_phyr_pglmm_model_iV_logdetV, 3},
+    {"_phyr_pglmm_model_V", (DL_FUNC) &_phyr_pglmm_model_V, 3},
+    {"_phyr_pglmm_model_iV_times", (DL_FUNC) &_phyr_pglmm_model_iV_times, 3},
+    {"_phyr_pglmm_model_iV_diag", (DL_FUNC) &_phyr_pglmm_model_iV_diag, 2},
+    {"_phyr_pglmm_model_logdetV", (DL_FUNC) &_phyr_pglmm_model_logdetV, 2},
+    {"_phyr_pglmm_model_V_times", (DL_FUNC) &_phyr_pglmm_model_V_times, 3},
+    {"_phyr_pglmm_model_iV_dense", (DL_FUNC) &_phyr_pglmm_model_iV_dense, 2},
+    {"_phyr_pglmm_model_gaussian_nearest", (DL_FUNC) &_phyr_pglmm_model_gaussian_nearest, 3},
+    {"_phyr_pglmm_model_gaussian_predict", (DL_FUNC) &_phyr_pglmm_model_gaussian_predict, 3},
+    {"_phyr_pglmm_model_profile_LRT", (DL_FUNC) &_phyr_pglmm_model_profile_LRT, 7},
     {"_phyr_which2", (DL_FUNC) &_phyr_which2, 1},
     {"_phyr_vcv_loop", (DL_FUNC) &_phyr_vcv_loop, 7},
     {"_phyr_cov2cor_cpp", (DL_FUNC) &_phyr_cov2cor_cpp, 1},
@@ -35,16 +35,12 @@ using namespace Rcpp;
 
 
 
-// `cor_phylo` log likelihood function.
-// 
-//[[Rcpp::export]]
-double cor_phylo_LL(NumericVector par,
-                    SEXP xptr) {
-  
-  XPtr<LogLikInfo> lli(xptr);
+// `cor_phylo` log likelihood function without deadline checks or tracking.
+inline double cor_phylo_LL_value(const NumericVector& par,
+                                 XPtr<LogLikInfo> lli) {
   
   const arma::mat& XX(lli->XX);
-  const arma::mat& UU(lli->UU);
+  const BlockUU& UU(lli->UU);
   const arma::mat& MM(lli->MM);
   const arma::mat& Vphy(lli->Vphy);
   const arma::mat& tau(lli->tau);
@@ -75,29 +71,26 @@ double cor_phylo_LL(NumericVector par,
   rcond_dbl = arma::rcond(V);
   if (!arma::is_finite(rcond_dbl) || rcond_dbl < rcond_threshold) return MAX_RETURN;
   
-  arma::mat iV = arma::inv(V);
-  arma::mat denom = UU.t() * iV * UU;
+  // Everything below uses the Cholesky decomposition of V instead of its inverse:
+  GLSInfo gls(V, UU, XX);
+  if (!gls.success) return MAX_RETURN;
+  const arma::mat& denom(gls.denom);
   rcond_dbl = arma::rcond(denom);
   if (!arma::is_finite(rcond_dbl) || rcond_dbl < rcond_threshold) return MAX_RETURN;
   
-  arma::mat num = UU.t() * iV * XX;
-  arma::vec B0 = arma::solve(denom, num);
-  arma::mat H = XX - UU * B0;
+  arma::vec B0 = arma::solve(denom, gls.num);
   
-  double logdetV, det_sign;
-  arma::log_det(logdetV, det_sign, iV);
+  const double& logdetV(gls.logdetV);
   if (!arma::is_finite(logdetV)) return MAX_RETURN;
-  logdetV *= -1;
   
   double LL;
   if (REML) {
-    arma::mat to_det = UU.t() * iV * UU;
-    double det_val;
-    arma::log_det(det_val, det_sign, to_det);
-    double lhs = arma::as_scalar(H.t() * iV * H);
+    double det_val, det_sign;
+    arma::log_det(det_val, det_sign, denom);
+    double lhs = gls.quad_form(B0, UU, XX);
     LL = 0.5 * (logdetV + det_val + lhs);
   } else {
-    LL = 0.5 * arma::as_scalar(logdetV + H.t() * iV * H);
+    LL = 0.5 * (logdetV + gls.quad_form(B0, UU, XX));
   }
   
   if (verbose) {
@@ -110,6 +103,30 @@ double cor_phylo_LL(NumericVector par,
 }
 
 
+// `cor_phylo` log likelihood function.
+// 
+// If the deadline has passed, this raises an error that the fitting functions
+// catch so they can return the best estimates so far.
+// 
+//[[Rcpp::export]]
+double cor_phylo_LL(NumericVector par,
+                    SEXP xptr) {
+  
+  XPtr<LogLikInfo> lli(xptr);
+  
+  if (lli->past_deadline()) {
+    lli->timed_out = true;
+    stop("\nThe time budget for `cor_phylo` was reached.");
+  }
+  
+  double LL = cor_phylo_LL_value(par, lli);
+  
+  lli->update_best(par, LL);
+  
+  return LL;
+}
+
+
 
 
 /*
@@ -123,7 +140,7 @@ std::vector<double> return_rcond_vals(XPtr<LogLikInfo> ll_info) {
   
   const arma::vec& par(ll_info->min_par);
   const arma::mat& XX(ll_info->XX);
-  const arma::mat& UU(ll_info->UU);
+  const BlockUU& UU(ll_info->UU);
   const arma::mat& MM(ll_info->MM);
   const arma::mat& Vphy(ll_info->Vphy);
   const arma::mat& tau(ll_info->tau);
@@ -152,9 +169,8 @@ std::vector<double> return_rcond_vals(XPtr<LogLikInfo> ll_info) {
   rcond_dbl = arma::rcond(V);
   rconds_out[0] = rcond_dbl;
   
-  arma::mat iV = arma::inv(V);
-  arma::mat denom = UU.t() * iV * UU;
-  rcond_dbl = arma::rcond(denom);
+  GLSInfo gls(V, UU, XX, true);
+  rcond_dbl = arma::rcond(gls.denom);
   rconds_out[1] = rcond_dbl;
   
   return rconds_out;
@@ -180,6 +196,47 @@ std::vector<double> return_rcond_vals(XPtr<LogLikInfo> ll_info) {
  ***************************************************************************************
  */
 
+/*
+ Evaluate a call to an optimizer.
+ 
+ If there's a deadline, the call is wrapped in `tryCatch` so that reaching it
+ (signaled by an error from `cor_phylo_LL`) doesn't stop everything.
+ In that case, this function returns `R_NilValue`, and `use_best_so_far` should
+ be used to fill in `ll_info`.
+ Other errors are passed on.
+ */
+SEXP eval_optimizer(const Rcpp::Language& call, XPtr<LogLikInfo> ll_info) {
+  if (!ll_info->has_deadline) return call.eval();
+  Rcpp::Environment base_env = Rcpp::Environment::base_env();
+  Rcpp::Function tryCatch = base_env["tryCatch"];
+  Rcpp::Function conditionMessage = base_env["conditionMessage"];
+  Rcpp::Language try_call(tryCatch, call, _["error"] = conditionMessage);
+  SEXP out = try_call.eval();
+  if (Rf_isString(out)) {
+    if (ll_info->timed_out) return R_NilValue;
+    stop(as<std::string>(out));
+  }
+  return out;
+}
+
+/*
+ Fill in `ll_info` with the best estimates so far after the deadline was reached.
+ Convergence code is 1, the same as for reaching the iteration limit.
+ */
+void use_best_so_far(XPtr<LogLikInfo> ll_info) {
+  if (ll_info->best_par.n_elem > 0) {
+    ll_info->min_par = ll_info->best_par;
+    ll_info->LL = ll_info->best_LL;
+  } else {
+    ll_info->min_par = ll_info->par0;
+    ll_info->LL = MAX_RETURN;
+  }
+  ll_info->convcode = 1;
+  ll_info->iters = ll_info->LL_trace.size();
+  return;
+}
+
+
 /*
  Fit cor_phylo model using nlopt.
  */
@@ -208,10 +265,17 @@ void fit_cor_phylo_nlopt(XPtr<LogLikInfo> ll_info,
   
   NumericVector par0(ll_info->par0.begin(), ll_info->par0.end());
   
-  List opt = nloptr(_["x0"] = par0,
-                   _["eval_f"] = cor_phylo_LL_fxn,
-                   _["opts"] = options,
-                   _["xptr"] = Rcpp::wrap(ll_info));
+  Rcpp::Language opt_call(nloptr,
+                          _["x0"] = par0,
+                          _["eval_f"] = cor_phylo_LL_fxn,
+                          _["opts"] = options,
+                          _["xptr"] = Rcpp::wrap(ll_info));
+  SEXP opt_sexp = eval_optimizer(opt_call, ll_info);
+  if (Rf_isNull(opt_sexp)) {
+    use_best_so_far(ll_info);
+    return;
+  }
+  List opt(opt_sexp);
   
   ll_info->min_par = as<arma::vec>(opt["solution"]);
   
@@ -260,27 +324,42 @@ void fit_cor_phylo_R(XPtr<LogLikInfo> ll_info,
   Rcpp::Function cor_phylo_LL_fxn = phyr_pkg["cor_phylo_LL"];
   
   Rcpp::List opt;
+  SEXP opt_sexp;
 
   NumericVector par0(ll_info->par0.begin(), ll_info->par0.end());
   
   if (method == "sann") {
-    opt = optim(_["par"] = par0,
-                _["fn"] = cor_phylo_LL_fxn,
-                _["method"] = "SANN",
-                _["control"] = List::create(_["maxit"] = sann[0],
-                                            _["temp"] = sann[1],
-                                            _["tmax"] = sann[2],
-                                            _["reltol"] = rel_tol),
-                _["xptr"] = Rcpp::wrap(ll_info));
+    Rcpp::Language sann_call(optim,
+                             _["par"] = par0,
+                             _["fn"] = cor_phylo_LL_fxn,
+                             _["method"] = "SANN",
+                             _["control"] = List::create(_["maxit"] = sann[0],
+                                                         _["temp"] = sann[1],
+                                                         _["tmax"] = sann[2],
+                                                         _["reltol"] = rel_tol),
+                             _["xptr"] = Rcpp::wrap(ll_info));
+    opt_sexp = eval_optimizer(sann_call, ll_info);
+    if (Rf_isNull(opt_sexp)) {
+      use_best_so_far(ll_info);
+      return;
+    }
+    opt = List(opt_sexp);
     par0 = as<NumericVector>(opt["par"]);
   }
   
-  opt = optim(_["par"] = par0,
-              _["fn"] = cor_phylo_LL_fxn,
-              _["method"] = "Nelder-Mead",
-              _["control"] = List::create(_["maxit"] = max_iter,
-                                          _["reltol"] = rel_tol),
-              _["xptr"] = Rcpp::wrap(ll_info));
+  Rcpp::Language nm_call(optim,
+                         _["par"] = par0,
+                         _["fn"] = cor_phylo_LL_fxn,
+                         _["method"] = "Nelder-Mead",
+                         _["control"] = List::create(_["maxit"] = max_iter,
+                                                     _["reltol"] = rel_tol),
+                         _["xptr"] = Rcpp::wrap(ll_info));
+  opt_sexp = eval_optimizer(nm_call, ll_info);
+  if (Rf_isNull(opt_sexp)) {
+    use_best_so_far(ll_info);
+    return;
+  }
+  opt = List(opt_sexp);
   
   ll_info->min_par = as<arma::vec>(opt["par"]);
   
@@ -300,6 +379,25 @@ void fit_cor_phylo_R(XPtr<LogLikInfo> ll_info,
 }
 
 
+/*
+ Fit `cor_phylo` model using the optimizer indicated by `method`.
+ Methods "nelder-mead-r" and "sann" use R's `stats::optim`.
+ Otherwise, use nlopt.
+ */
+inline void fit_cor_phylo(XPtr<LogLikInfo> ll_info,
+                          const double& rel_tol,
+                          const int& max_iter,
+                          const std::string& method,
+                          const std::vector<double>& sann) {
+  if (method == "nelder-mead-r" || method == "sann") {
+    fit_cor_phylo_R(ll_info, rel_tol, max_iter, method, sann);
+  } else {
+    fit_cor_phylo_nlopt(ll_info, rel_tol, max_iter, method);
+  }
+  return;
+}
+
+
 
 /*
  ***************************************************************************************
@@ -369,7 +467,9 @@ LogLikInfo::LogLikInfo(const arma::mat& X,
                  const bool& verbose_,
                  const double& rcond_threshold_) 
   : REML(REML_), no_corr(no_corr_), constrain_d(constrain_d_), lower_d(lower_d_),
-    verbose(verbose_), rcond_threshold(rcond_threshold_), iters(0) {
+    verbose(verbose_), rcond_threshold(rcond_threshold_), iters(0),
+    has_deadline(false), deadline(), timed_out(false), best_par(),
+    best_LL(arma::datum::inf), LL_trace() {
   
   uint_t n = Vphy_.n_rows;
   uint_t p = X.n_cols;
@@ -392,8 +492,8 @@ LogLikInfo::LogLikInfo(const arma::mat& X,
   XX = arma::reshape(Xs, Xs.n_elem, 1);
   MM = flex_pow(Ms, 2);
   MM.reshape(MM.n_elem, 1);
-  UU = arma::kron(arma::eye<arma::mat>(p,p),
-                  arma::mat(n, 1, arma::fill::ones));
+  // Only the nonzero n-row block for each variate is stored (see `BlockUU`):
+  std::vector<arma::mat> UU_blocks(p, arma::mat(n, 1, arma::fill::ones));
   
   if (U.size() > 0) {
     arma::vec zeros(p, arma::fill::zeros);
@@ -403,12 +503,12 @@ LogLikInfo::LogLikInfo(const arma::mat& X,
       arma::mat u = arma::kron(dd, Us[i]);
       for (uint_t j = 0; j < u.n_cols; j++) {
         if (arma::diff(u.col(j)).max() > 0) {
-          UU.insert_cols(UU.n_cols,1);
-          UU.col(UU.n_cols-1) = u.col(j);
+          UU_blocks[i].insert_cols(UU_blocks[i].n_cols, Us[i].col(j));
         }
       }
     }
   }
+  UU = BlockUU(n, UU_blocks);
   
   arma::mat L;
   arma::mat eps = Xs;
@@ -454,7 +554,9 @@ LogLikInfo::LogLikInfo(const arma::mat& X,
                  XPtr<LogLikInfo> other) 
   : UU(other->UU), Vphy(other->Vphy), tau(other->tau), REML(other->REML),
     no_corr(other->no_corr), constrain_d(other->constrain_d), lower_d(other->lower_d),
-    verbose(other->verbose), rcond_threshold(other->rcond_threshold), iters(0) {
+    verbose(other->verbose), rcond_threshold(other->rcond_threshold), iters(0),
+    has_deadline(other->has_deadline), deadline(other->deadline), timed_out(false),
+    best_par(), best_LL(arma::datum::inf), LL_trace() {
 
   uint_t p = X.n_cols;
   
@@ -513,15 +615,11 @@ inline void main_output(arma::mat& corrs, arma::mat& B, arma::mat& B_cov, arma::
   
   arma::mat V = make_V(C, ll_info->MM);
   
-  arma::mat iV = arma::inv(V);
-  
-  arma::mat denom = ll_info->UU.t() * iV * ll_info->UU;
+  GLSInfo gls(V, ll_info->UU, ll_info->XX, true);
   
-  arma::mat num = ll_info->UU.t() * iV * ll_info->XX;
+  arma::vec B0 = arma::solve(gls.denom, gls.num);
   
-  arma::vec B0 = arma::solve(denom, num);
-  
-  make_B_B_cov(B, B_cov, B0, iV, ll_info->UU, X, U);
+  make_B_B_cov(B, B_cov, B0, gls.denom, X, U);
   
   return;
 }
@@ -542,7 +640,9 @@ List cp_get_output(const arma::mat& X,
                    const std::string& method,
                    const uint_t& boot,
                    const std::string& keep_boots,
-                   const std::vector<double>& sann) {
+                   const std::vector<double>& sann,
+                   const std::vector<std::string>& retry_methods,
+                   const uint_t& retry_restarts) {
 
   
   uint_t n = X.n_rows;
@@ -578,15 +678,29 @@ List cp_get_output(const arma::mat& X,
   
   std::vector<double> rcond_vals = return_rcond_vals(ll_info);
   
+  // Best log likelihood after each evaluation (NA until one is valid):
+  std::vector<double> LL_trace(ll_info->LL_trace.size());
+  for (uint_t i = 0; i < LL_trace.size(); i++) {
+    const double& LLi(ll_info->LL_trace[i]);
+    LL_trace[i] = (LLi < MAX_RETURN) ? (logLik + ll_info->LL - LLi) : NA_REAL;
+  }
+  
   List boot_list = List::create();
   if (boot > 0) {
     // `BootMats` stores matrices that we'll need for bootstrapping
     BootMats bm(X, U, M, B, d, ll_info);
     BootResults br(p, B.n_rows, boot);
+    // Replicates stop when the time budget (if any) runs out:
+    uint_t n_completed = 0;
     for (uint_t b = 0; b < boot; b++) {
       Rcpp::checkUserInterrupt();
-      bm.one_boot(ll_info, br, b, rel_tol, max_iter, method, keep_boots, sann);
+      if (ll_info->past_deadline()) break;
+      bool completed = bm.one_boot(ll_info, br, b, rel_tol, max_iter, method,
+                                   keep_boots, sann, retry_methods, retry_restarts);
+      if (!completed) break;
+      n_completed++;
     }
+    if (n_completed < boot) br.keep_first(n_completed);
     std::vector<NumericMatrix> boot_out_mats(br.out_inds.size());
     for (uint_t i = 0; i < br.out_inds.size(); i++) {
       boot_out_mats[i] = wrap(br.out_mats[i]);
@@ -595,7 +709,12 @@ List cp_get_output(const arma::mat& X,
                              _["B0"] = br.B0, _["B_cov"] = br.B_cov,
                              _["inds"] = br.out_inds,
                              _["convcodes"] = br.out_codes,
-                             _["mats"] = boot_out_mats);
+                             _["mats"] = boot_out_mats,
+                             _["rep_convcodes"] = br.rep_codes,
+                             _["rep_retries"] = br.rep_retries,
+                             _["rep_methods"] = br.rep_methods,
+                             _["n_completed"] = n_completed,
+                             _["timed_out"] = n_completed < boot);
   }
   
   // Now the final output list
@@ -610,6 +729,8 @@ List cp_get_output(const arma::mat& X,
     _["niter"] = ll_info->iters,
     _["convcode"] = ll_info->convcode,
     _["rcond_vals"] = rcond_vals,
+    _["timed_out"] = ll_info->timed_out,
+    _["LL_trace"] = LL_trace,
     _["bootstrap"] = boot_list
   );
   
@@ -628,6 +749,11 @@ List cp_get_output(const arma::mat& X,
 //' @param Vphy_ phylogenetic variance-covariance matrix from the input phylogeny.
 //' @inheritParams cor_phylo
 //' @param method the `method` input to `cor_phylo`.
+//' @param retry_methods methods to try, in order, when a bootstrap replicate fails
+//'   to converge. Empty for no retries.
+//' @param retry_restarts number of restarts for each method in `retry_methods`.
+//' @param max_time time budget in seconds for fitting and bootstrapping.
+//'   Use `Inf` for no budget.
 //' 
 //' @return a list containing output information, to later be coerced to a `cor_phylo`
 //'   object by the `cor_phylo` function.
@@ -650,28 +776,25 @@ List cor_phylo_cpp(const arma::mat& X,
                    const bool& no_corr,
                    const uint_fast32_t& boot,
                    const std::string& keep_boots,
-                   const std::vector<double>& sann) {
+                   const std::vector<double>& sann,
+                   const std::vector<std::string>& retry_methods,
+                   const uint_fast32_t& retry_restarts,
+                   const double& max_time) {
   
 
   // LogLikInfo is C++ class to use for organizing info for optimizing
   XPtr<LogLikInfo> ll_info(new LogLikInfo(X, U, M, Vphy_, REML, no_corr, constrain_d, 
                                           lower_d, verbose, rcond_threshold), true);
+  // Time budget applies to the fit and the bootstrapping:
+  ll_info->set_deadline(max_time);
 
-  /*
-   Do the fitting.
-   Methods "nelder-mead-r" and "sann" use R's `stats::optim`.
-   Otherwise, use nlopt.
-   */
-  if (method == "nelder-mead-r" || method == "sann") {
-    fit_cor_phylo_R(ll_info, rel_tol, max_iter, method, sann);
-  } else {
-    fit_cor_phylo_nlopt(ll_info, rel_tol, max_iter, method);
-  }
+  // Do the fitting.
+  fit_cor_phylo(ll_info, rel_tol, max_iter, method, sann);
   
   // Retrieve output from `ll_info` object and convert to list
   // Also do bootstrapping if desired
   List output = cp_get_output(X, U, M, ll_info, rel_tol, max_iter, method,
-                              boot, keep_boots, sann);
+                              boot, keep_boots, sann, retry_methods, retry_restarts);
   
   return output;
   
@@ -722,10 +845,7 @@ BootMats::BootMats(const arma::mat& X_,
   iD = iD.t();
   
   // For predicted X values (i.e., without error)
-  X_pred = ll_info->UU.t();
-  arma::rowvec tmp = B_.col(0).t();
-  X_pred = tmp * X_pred;
-  X_pred = X_pred.t();
+  X_pred = ll_info->UU.times(B_.col(0));
   X_pred.reshape(n, p);
   
   return;
@@ -772,26 +892,64 @@ void BootMats::boot_data(XPtr<LogLikInfo> ll_info, BootResults& br, const uint_t
   return;
 }
 
-void BootMats::one_boot(XPtr<LogLikInfo> ll_info, BootResults& br,
+bool BootMats::one_boot(XPtr<LogLikInfo> ll_info, BootResults& br,
                         const uint_t& i, const double& rel_tol, const int& max_iter,
                         const std::string& method, const std::string& keep_boots,
-                        const std::vector<double>& sann) {
+                        const std::vector<double>& sann,
+                        const std::vector<std::string>& retry_methods,
+                        const uint_t& retry_restarts) {
   
   // Generate new data
   XPtr<LogLikInfo> new_ll_info = iterate(ll_info);
   
+  // Do the fitting:
+  fit_cor_phylo(new_ll_info, rel_tol, max_iter, method, sann);
+  // Replicates that hit the deadline aren't counted:
+  if (new_ll_info->timed_out) return false;
+  
   /*
-   Do the fitting.
-   Methods "nelder-mead-r" and "sann" use R's `stats::optim`.
-   Otherwise, use nlopt.
+   If it didn't converge, go through the fallback chain.
+   Each method in `retry_methods` starts from the best estimates so far and gets
+   `retry_restarts` restarts, each from where the previous try stopped.
+   We stop at the first fit that converges.
+   If none converge, we keep the fit with the lowest log likelihood.
    */
-  if (method == "nelder-mead-r" || method == "sann") {
-    // Do the fitting:
-    fit_cor_phylo_R(new_ll_info, rel_tol, max_iter, method, sann);
-  } else {
-    // Same thing for nlopt version
-    fit_cor_phylo_nlopt(new_ll_info, rel_tol, max_iter, method);
+  uint_t n_retries = 0;
+  std::string final_method = method;
+  if (new_ll_info->convcode != 0 && !retry_methods.empty()) {
+    arma::vec best_par = new_ll_info->min_par;
+    double best_LL = new_ll_info->LL;
+    int best_code = new_ll_info->convcode;
+    uint_t best_iters = new_ll_info->iters;
+    std::string best_method = method;
+    for (uint_t j = 0; j < retry_methods.size(); j++) {
+      new_ll_info->par0 = best_par;
+      for (uint_t k = 0; k <= retry_restarts; k++) {
+        fit_cor_phylo(new_ll_info, rel_tol, max_iter, retry_methods[j], sann);
+        if (new_ll_info->timed_out) return false;
+        new_ll_info->par0 = new_ll_info->min_par;
+        n_retries++;
+        if (new_ll_info->convcode == 0 || new_ll_info->LL < best_LL) {
+          best_par = new_ll_info->min_par;
+          best_LL = new_ll_info->LL;
+          best_code = new_ll_info->convcode;
+          best_iters = new_ll_info->iters;
+          best_method = retry_methods[j];
+        }
+        if (best_code == 0) break;
+      }
+      if (best_code == 0) break;
+    }
+    new_ll_info->min_par = best_par;
+    new_ll_info->LL = best_LL;
+    new_ll_info->convcode = best_code;
+    new_ll_info->iters = best_iters;
+    final_method = best_method;
   }
+  br.rep_retries[i] = n_retries;
+  br.rep_codes[i] = new_ll_info->convcode;
+  br.rep_methods[i] = final_method;
+  
   // Determine whether convergence failed:
   bool failed = new_ll_info->convcode != 0;
   
@@ -808,6 +966,5 @@ void BootMats::one_boot(XPtr<LogLikInfo> ll_info, BootResults& br,
   // Add values to BootResults
   br.insert_values(i, corrs, B.col(0), B_cov, d);
   
-  return;
+  return true;
 }
-
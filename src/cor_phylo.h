@@ -7,6 +7,7 @@
 #include <numeric>
 #include <cmath>
 #include <vector>
+#include <chrono>
 #include <math.h>
 
 
@@ -32,12 +33,144 @@ using namespace Rcpp;
 
 
 
+/*
+ Design matrix for the GLS step.
+ 
+ `UU` is block-diagonal: the rows for variate i (rows i*n to (i+1)*n - 1) are 
+ nonzero only in the columns for that variate's intercept and covariates.
+ This class stores only the n x k_i block for each variate.
+ Columns (and so the coefficients in `B0`) are ordered by variate: variate 1's
+ intercept and then its covariates, then variate 2's intercept and covariates,
+ and so on. This is the order that `make_B_B_cov` and the row names of `B` in the
+ R output assume.
+ */
+class BlockUU {
+public:
+  std::vector<arma::mat> blocks;
+  std::vector<uint_t> col_starts;
+  uint_t n;
+  uint_t n_cols;
+  
+  BlockUU() : blocks(), col_starts(), n(0), n_cols(0) {}
+  BlockUU(const uint_t& n_, const std::vector<arma::mat>& blocks_)
+    : blocks(blocks_), col_starts(blocks_.size()), n(n_), n_cols(0) {
+    for (uint_t i = 0; i < blocks.size(); i++) {
+      col_starts[i] = n_cols;
+      n_cols += blocks[i].n_cols;
+    }
+  }
+  
+  // UU * b
+  arma::vec times(const arma::vec& b) const {
+    arma::vec out(n * blocks.size());
+    for (uint_t i = 0; i < blocks.size(); i++) {
+      const arma::mat& Ui(blocks[i]);
+      out.subvec(i * n, (i + 1) * n - 1) =
+        Ui * b.subvec(col_starts[i], col_starts[i] + Ui.n_cols - 1);
+    }
+    return out;
+  }
+  // UU.t() * A
+  arma::mat t_times(const arma::mat& A) const {
+    arma::mat out(n_cols, A.n_cols);
+    for (uint_t i = 0; i < blocks.size(); i++) {
+      const arma::mat& Ui(blocks[i]);
+      out.rows(col_starts[i], col_starts[i] + Ui.n_cols - 1) =
+        Ui.t() * A.rows(i * n, (i + 1) * n - 1);
+    }
+    return out;
+  }
+  // A * UU
+  arma::mat right_times(const arma::mat& A) const {
+    arma::mat out(A.n_rows, n_cols);
+    for (uint_t i = 0; i < blocks.size(); i++) {
+      const arma::mat& Ui(blocks[i]);
+      out.cols(col_starts[i], col_starts[i] + Ui.n_cols - 1) =
+        A.cols(i * n, (i + 1) * n - 1) * Ui;
+    }
+    return out;
+  }
+  /*
+   L^-1 * UU for lower-triangular L.
+   Rows above each block are zero in both UU and the solution, so each block
+   only needs the trailing part of L.
+   */
+  arma::mat lower_solve(const arma::mat& L) const {
+    uint_t N = L.n_rows;
+    arma::mat out(N, n_cols, arma::fill::zeros);
+    for (uint_t i = 0; i < blocks.size(); i++) {
+      const arma::mat& Ui(blocks[i]);
+      uint_t r0 = i * n;
+      arma::mat rhs(N - r0, Ui.n_cols, arma::fill::zeros);
+      rhs.rows(0, n - 1) = Ui;
+      arma::mat Li = L.submat(r0, r0, N - 1, N - 1);
+      out.submat(r0, col_starts[i], N - 1, col_starts[i] + Ui.n_cols - 1) =
+        arma::solve(arma::trimatl(Li), rhs);
+    }
+    return out;
+  }
+};
+
+
+
+/*
+ Parts of the GLS step, computed from the Cholesky decomposition of V.
+ 
+ If the decomposition fails, `success` is false. If `inv_fallback` is true, `denom`, 
+ `num`, and `logdetV` are then calculated from the inverse of V instead.
+ */
+class GLSInfo {
+public:
+  arma::mat denom;  // UU' V^-1 UU
+  arma::mat num;    // UU' V^-1 XX
+  double logdetV;
+  bool success;
+  
+  GLSInfo(const arma::mat& V, const BlockUU& UU, const arma::mat& XX,
+          const bool& inv_fallback = false)
+    : denom(), num(), logdetV(0), success(false), Wt(), Xt(), iV() {
+    
+    arma::mat L;
+    success = arma::chol(L, V, "lower");
+    if (success) {
+      Wt = UU.lower_solve(L);
+      Xt = arma::solve(arma::trimatl(L), XX);
+      denom = Wt.t() * Wt;
+      num = Wt.t() * Xt;
+      logdetV = 2 * arma::accu(arma::log(L.diag()));
+    } else if (inv_fallback) {
+      iV = arma::inv(V);
+      denom = UU.t_times(UU.right_times(iV));
+      num = UU.t_times(iV * XX);
+      double det_sign;
+      arma::log_det(logdetV, det_sign, V);
+    }
+  }
+  
+  // H' V^-1 H for H = XX - UU * B0
+  double quad_form(const arma::vec& B0, const BlockUU& UU, const arma::mat& XX) const {
+    if (success) {
+      arma::vec Ht = Xt - Wt * B0;
+      return arma::dot(Ht, Ht);
+    }
+    arma::vec H = XX - UU.times(B0);
+    return arma::as_scalar(H.t() * iV * H);
+  }
+  
+private:
+  arma::mat Wt;     // L^-1 UU
+  arma::mat Xt;     // L^-1 XX
+  arma::mat iV;     // only used if the Cholesky decomposition fails
+};
+
+
+
 // Info to calculate the log-likelihood
 class LogLikInfo {
 public:
   arma::vec par0;  // par to start with
   arma::mat XX;
-  arma::mat UU;
+  BlockUU UU;
   arma::mat MM;
   arma::mat Vphy;
   arma::mat tau;
@@ -51,6 +184,13 @@ public:
   arma::vec min_par; // par for minimum LL
   double LL;
   int convcode;
+  // For stopping at a wall-clock deadline:
+  bool has_deadline;
+  std::chrono::steady_clock::time_point deadline;
+  bool timed_out;
+  arma::vec best_par;             // best par evaluated so far
+  double best_LL;                 // LL for `best_par`
+  std::vector<double> LL_trace;   // `best_LL` after each evaluation
   
   LogLikInfo() {}
   LogLikInfo(const arma::mat& X,
@@ -86,6 +226,33 @@ public:
     min_par = ll_info2.min_par;
     LL = ll_info2.LL;
     convcode = ll_info2.convcode;
+    has_deadline = ll_info2.has_deadline;
+    deadline = ll_info2.deadline;
+    timed_out = ll_info2.timed_out;
+    best_par = ll_info2.best_par;
+    best_LL = ll_info2.best_LL;
+    LL_trace = ll_info2.LL_trace;
+  }
+  
+  // Set deadline `max_time` seconds from now (no deadline if not finite)
+  void set_deadline(const double& max_time) {
+    has_deadline = std::isfinite(max_time);
+    if (has_deadline) {
+      deadline = std::chrono::steady_clock::now() +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(max_time));
+    }
+  }
+  bool past_deadline() const {
+    return has_deadline && std::chrono::steady_clock::now() >= deadline;
+  }
+  // Keep track of the best evaluation so far
+  void update_best(const NumericVector& par, const double& LL_) {
+    if (LL_ < best_LL) {
+      best_LL = LL_;
+      best_par = as<arma::vec>(par);
+    }
+    LL_trace.push_back(best_LL);
   }
   
 };
@@ -103,13 +270,18 @@ public:
   std::vector<arma::mat> out_mats;
   std::vector<uint_t> out_inds;
   std::vector<int> out_codes;
+  // Replicate-level info on the convergence fallback chain (one item per replicate):
+  std::vector<uint_t> rep_retries;        // number of re-fits after the first fit
+  std::vector<int> rep_codes;             // convergence code of the final fit
+  std::vector<std::string> rep_methods;   // method used for the final fit
 
   BootResults(const uint_t& p, const uint_t& B_rows, const uint_t& n_reps) 
     : corrs(p, p, n_reps, arma::fill::zeros), 
       B0(B_rows, n_reps, arma::fill::zeros), 
       B_cov(B_rows, B_rows, n_reps, arma::fill::zeros),
       d(p, n_reps, arma::fill::zeros), 
-      out_mats(), out_inds(), out_codes() {};
+      out_mats(), out_inds(), out_codes(),
+      rep_retries(n_reps, 0), rep_codes(n_reps, 0), rep_methods(n_reps, "") {};
 
   // Insert values into a BootResults object
   void insert_values(const uint_t& i,
@@ -126,6 +298,18 @@ public:
     
   }
   
+  // Only keep the first `n_reps` replicates (used when the time budget ran out)
+  void keep_first(const uint_t& n_reps) {
+    corrs.resize(corrs.n_rows, corrs.n_cols, n_reps);
+    B0.resize(B0.n_rows, n_reps);
+    B_cov.resize(B_cov.n_rows, B_cov.n_cols, n_reps);
+    d.resize(d.n_rows, n_reps);
+    rep_retries.resize(n_reps);
+    rep_codes.resize(n_reps);
+    rep_methods.resize(n_reps);
+    return;
+  }
+  
 };
 
 
@@ -147,10 +331,12 @@ public:
   
   XPtr<LogLikInfo> iterate(XPtr<LogLikInfo> ll_info);
   
-  void one_boot(XPtr<LogLikInfo> ll_info, BootResults& br,
+  bool one_boot(XPtr<LogLikInfo> ll_info, BootResults& br,
                 const uint_t& i, const double& rel_tol, const int& max_iter,
                 const std::string& method, const std::string& keep_boots,
-                const std::vector<double>& sann);
+                const std::vector<double>& sann,
+                const std::vector<std::string>& retry_methods,
+                const uint_t& retry_restarts);
   
   
 private:
@@ -440,8 +626,7 @@ inline arma::mat make_corrs(const arma::mat& R) {
  Make matrices of coefficient estimates and standard errors, and matrix of covariances.
  */
 inline void make_B_B_cov(arma::mat& B, arma::mat& B_cov, arma::vec& B0,
-                         const arma::mat& iV,
-                         const arma::mat& UU,
+                         const arma::mat& denom,
                          const arma::mat& X,
                          const std::vector<arma::mat>& U) {
   
@@ -453,7 +638,7 @@ inline void make_B_B_cov(arma::mat& B, arma::mat& B_cov, arma::vec& B0,
     if (U[i].n_cols > 0) sd_U[i] = arma::conv_to<arma::vec>::from(arma::stddev(U[i]));
   }
   
-  arma::vec sd_vec(UU.n_cols, arma::fill::zeros);
+  arma::vec sd_vec(denom.n_cols, arma::fill::zeros);
   
   for (uint_t counter = 0, i = 0; i < X.n_cols; counter++, i++) {
     B0[counter] += mean_sd_X(i,0);
@@ -471,7 +656,7 @@ inline void make_B_B_cov(arma::mat& B, arma::mat& B_cov, arma::vec& B0,
     }
   }
   
-  B_cov = arma::inv(UU.t() * iV * UU);
+  B_cov = arma::inv(denom);
   B_cov = arma::diagmat(sd_vec) * B_cov * arma::diagmat(sd_vec);
   
   B.set_size(B0.n_elem, 4);
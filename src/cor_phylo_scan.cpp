@@ -0,0 +1,363 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <RcppArmadillo.h>
+#include <numeric>
+#include <cmath>
+#include <vector>
+#include <limits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "cor_phylo.h"
+
+using namespace Rcpp;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Univariate (p = 1) phylogenetic-signal scan
+
+ For a single variate, V = sigma^2 * C(d), so sigma^2 can be profiled out of the
+ likelihood and only `d` needs to be optimized.
+ The tree-based matrices are shared by all traits, and every evaluation at a given
+ `d` handles a whole batch of traits using one Cholesky decomposition of C(d).
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+
+
+// Tree info shared by all traits in a scan
+class ScanTree {
+public:
+  arma::mat Vphy;
+  arma::mat tau;
+  arma::mat D;      // design matrix: intercept plus any covariates
+  bool REML;
+
+  ScanTree(const arma::mat& Vphy_, const arma::mat& U, const bool& REML_)
+    : REML(REML_) {
+
+    uint_t n = Vphy_.n_rows;
+
+    // Same standardization as in `LogLikInfo`
+    Vphy = Vphy_;
+    Vphy /= Vphy_.max();
+    double val, sign;
+    arma::log_det(val, sign, Vphy);
+    val = std::exp(val / n);
+    Vphy /= val;
+
+    tau = arma::vec(n, arma::fill::ones) * Vphy.diag().t() - Vphy;
+
+    D = arma::mat(n, 1, arma::fill::ones);
+    if (U.n_cols > 0) D.insert_cols(1, U);
+  }
+
+  // OU transform for p = 1
+  // The limit as d -> 1 is used when d is very close to 1 to avoid 0 / 0.
+  arma::mat make_C(const double& d) const {
+    uint_t n = Vphy.n_rows;
+    arma::mat C(n, n);
+    double dd = d * d;
+    if (std::abs(1 - dd) < 1e-8) {
+      for (uint_t j = 0; j < n; j++) {
+        for (uint_t i = 0; i < n; i++) {
+          C(i,j) = std::pow(d, tau(i,j) + tau(j,i)) * Vphy(i,j);
+        }
+      }
+    } else {
+      for (uint_t j = 0; j < n; j++) {
+        for (uint_t i = 0; i < n; i++) {
+          C(i,j) = std::pow(d, tau(i,j) + tau(j,i)) * (1 - std::pow(dd, Vphy(i,j)));
+        }
+      }
+      C /= (1 - dd);
+    }
+    return C;
+  }
+
+  /*
+   Profiled -2 * log likelihood (minus constants) for each column in `X` at a
+   given `d`.
+   If `B` and `s2` aren't NULL, the coefficient estimates and profiled variances
+   are also stored there.
+   Returns `MAX_SCAN` for all traits if C(d) or D' C^-1 D is not positive definite.
+   This function doesn't use the R API, so it's safe to call from multiple threads.
+   */
+  arma::vec objective(const double& d, const arma::mat& X,
+                      arma::mat* B = nullptr, arma::vec* s2 = nullptr) const {
+
+    uint_t n = X.n_rows, k = D.n_cols;
+    double nk = REML ? static_cast<double>(n - k) : static_cast<double>(n);
+
+    arma::vec out(X.n_cols);
+    out.fill(MAX_SCAN);
+
+    arma::mat L;
+    bool success = arma::chol(L, make_C(d), "lower");
+    if (!success) return out;
+    double logdetC = 2 * arma::accu(arma::log(L.diag()));
+
+    arma::mat Dt = arma::solve(arma::trimatl(L), D);
+    arma::mat Xt = arma::solve(arma::trimatl(L), X);
+
+    arma::mat DtD = Dt.t() * Dt;
+    arma::mat R_DtD;
+    success = arma::chol(R_DtD, DtD);
+    if (!success) return out;
+    double logdetDtD = 2 * arma::accu(arma::log(R_DtD.diag()));
+
+    arma::mat Bhat = arma::solve(arma::trimatu(R_DtD),
+                                 arma::solve(arma::trimatl(R_DtD.t()), Dt.t() * Xt));
+    arma::mat res = Xt - Dt * Bhat;
+    arma::rowvec Q = arma::sum(arma::square(res), 0);
+
+    for (uint_t j = 0; j < X.n_cols; j++) {
+      out(j) = nk * std::log(Q(j)) + logdetC;
+      if (REML) out(j) += logdetDtD;
+    }
+
+    if (B != nullptr) *B = Bhat;
+    if (s2 != nullptr) *s2 = Q.t() / nk;
+
+    return out;
+  }
+
+  static constexpr double MAX_SCAN = 10000000000.0;
+
+};
+
+
+
+
+/*
+ Brent's method for a one-dimensional minimum on [ax, bx], as in R's `optimize`.
+ `fn` returns the value to minimize, and `iters` gets the number of evaluations.
+ Returns 0 if the tolerance was reached and 1 if `max_iter` evaluations were used.
+ */
+template <typename F>
+int brent_min(F fn, const double& ax, const double& bx, const double& tol,
+              const int& max_iter, double& x_min, double& f_min, int& iters) {
+
+  // squared inverse of the golden ratio
+  const double c = (3. - std::sqrt(5.)) * .5;
+  double a, b, d, e, p, q, r, u, v, w, x;
+  double t2, fu, fv, fw, fx, xm, eps, tol1, tol3;
+
+  eps = std::sqrt(std::numeric_limits<double>::epsilon());
+
+  a = ax;
+  b = bx;
+  v = a + c * (b - a);
+  w = v;
+  x = v;
+
+  d = 0.;
+  e = 0.;
+  fx = fn(x);
+  iters = 1;
+  fv = fx;
+  fw = fx;
+  tol3 = tol / 3.;
+
+  int code = 1;
+
+  while (iters < max_iter) {
+    xm = (a + b) * .5;
+    tol1 = eps * std::abs(x) + tol3;
+    t2 = tol1 * 2.;
+
+    // check stopping criterion
+    if (std::abs(x - xm) <= t2 - (b - a) * .5) {
+      code = 0;
+      break;
+    }
+    p = 0.;
+    q = 0.;
+    r = 0.;
+    if (std::abs(e) > tol1) { // fit parabola
+      r = (x - w) * (fx - fv);
+      q = (x - v) * (fx - fw);
+      p = (x - v) * q - (x - w) * r;
+      q = (q - r) * 2.;
+      if (q > 0.) p = -p; else q = -q;
+      r = e;
+      e = d;
+    }
+
+    if (std::abs(p) >= std::abs(q * .5 * r) ||
+        p <= q * (a - x) || p >= q * (b - x)) { // a golden-section step
+      if (x < xm) e = b - x; else e = a - x;
+      d = c * e;
+    } else { // a parabolic-interpolation step
+      d = p / q;
+      u = x + d;
+      // f must not be evaluated too close to ax or bx
+      if (u - a < t2 || b - u < t2) {
+        d = tol1;
+        if (x >= xm) d = -d;
+      }
+    }
+
+    // f must not be evaluated too close to x
+    if (std::abs(d) >= tol1) {
+      u = x + d;
+    } else if (d > 0.) {
+      u = x + tol1;
+    } else {
+      u = x - tol1;
+    }
+
+    fu = fn(u);
+    iters++;
+
+    //  update  a, b, v, w, and x
+    if (fu <= fx) {
+      if (u < x) b = x; else a = x;
+      v = w;    w = x;   x = u;
+      fv = fw; fw = fx; fx = fu;
+    } else {
+      if (u < x) a = u; else b = u;
+      if (fu <= fw || w == x) {
+        v = w; fv = fw;
+        w = u; fw = fu;
+      } else if (fu <= fv || v == x || v == w) {
+        v = u; fv = fu;
+      }
+    }
+  }
+
+  x_min = x;
+  f_min = fx;
+
+  return code;
+}
+
+
+
+
+//' Inner function to estimate phylogenetic signal for many single variates.
+//'
+//' @param X a n x m matrix with m columns, each containing the values of one trait
+//'   for the n taxa.
+//' @param U a n x k matrix of covariates shared by all traits (k can be zero).
+//' @param Vphy_ phylogenetic variance-covariance matrix from the input phylogeny.
+//' @inheritParams cor_phylo_scan
+//'
+//' @return a list containing output information, to later be coerced to a data frame
+//'   by the `cor_phylo_scan` function.
+//' @noRd
+//' @name cor_phylo_scan_cpp
+//'
+//[[Rcpp::export]]
+List cor_phylo_scan_cpp(const arma::mat& X,
+                        const arma::mat& U,
+                        const arma::mat& Vphy_,
+                        const bool& REML,
+                        const double& lower_d,
+                        const double& upper_d,
+                        const uint_fast32_t& n_grid,
+                        const double& rel_tol,
+                        const int& max_iter,
+                        const uint_fast32_t& batch_size,
+                        const uint_fast32_t& n_threads) {
+
+  if (upper_d <= lower_d) stop("\nINTERNAL ERROR: upper_d <= lower_d in scan");
+  if (n_grid < 3) stop("\nINTERNAL ERROR: n_grid < 3 in scan");
+
+  const ScanTree tree(Vphy_, U, REML);
+
+  uint_t n = X.n_rows, m = X.n_cols, k = tree.D.n_cols;
+
+  // Grid of `d` values used to bracket each trait's minimum:
+  arma::vec grid(n_grid);
+  for (uint_t j = 0; j < n_grid; j++) {
+    grid(j) = lower_d + (upper_d - lower_d) * (j + 0.5) / n_grid;
+  }
+  double tol = rel_tol * (upper_d - lower_d);
+
+  arma::vec d_out(m), obj_out(m), s2_out(m);
+  arma::mat B_out(k, m);
+  std::vector<int> iters_out(m), convcodes(m);
+
+  int n_thr = std::max(static_cast<int>(n_threads), 1);
+
+  for (uint_t b0 = 0; b0 < m; b0 += batch_size) {
+
+    Rcpp::checkUserInterrupt();
+
+    uint_t b1 = std::min(b0 + batch_size, m) - 1;
+    const arma::mat Xb = X.cols(b0, b1);
+    uint_t mb = Xb.n_cols;
+
+    // Objective values for all traits in this batch at all grid points:
+    arma::mat grid_obj(n_grid, mb);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_thr)
+#endif
+    for (uint_t j = 0; j < n_grid; j++) {
+      grid_obj.row(j) = tree.objective(grid(j), Xb).t();
+    }
+
+    // Refine each trait within the bracket around its best grid point:
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_thr)
+#endif
+    for (uint_t i = 0; i < mb; i++) {
+
+      const arma::mat x = Xb.col(i);
+      uint_t jmin = grid_obj.col(i).index_min();
+      double a = (jmin == 0) ? lower_d : grid(jmin - 1);
+      double b = (jmin == n_grid - 1) ? upper_d : grid(jmin + 1);
+
+      auto fn = [&tree, &x](const double& d) {
+        return tree.objective(d, x)(0);
+      };
+      double d_min, f_min;
+      int iters;
+      int code = brent_min(fn, a, b, tol, max_iter, d_min, f_min, iters);
+      // Keep the grid point if refining made it worse (e.g., a boundary minimum):
+      if (grid_obj(jmin, i) < f_min) {
+        d_min = grid(jmin);
+        f_min = grid_obj(jmin, i);
+      }
+
+      arma::mat Bi;
+      arma::vec s2i;
+      tree.objective(d_min, x, &Bi, &s2i);
+
+      uint_t ii = b0 + i;
+      d_out(ii) = d_min;
+      obj_out(ii) = f_min;
+      s2_out(ii) = s2i(0);
+      B_out.col(ii) = Bi.col(0);
+      iters_out[ii] = iters + n_grid;
+      convcodes[ii] = (f_min >= ScanTree::MAX_SCAN) ? 2 : code;
+    }
+  }
+
+  // Convert profiled objective to log likelihood:
+  double nk = REML ? static_cast<double>(n - k) : static_cast<double>(n);
+  arma::vec logLik = -0.5 * (obj_out + nk * (std::log(2 * arma::datum::pi) -
+    std::log(nk) + 1));
+
+  List out = List::create(_["d"] = d_out,
+                          _["sigma2"] = s2_out,
+                          _["B"] = B_out,
+                          _["logLik"] = logLik,
+                          _["niter"] = iters_out,
+                          _["convcode"] = convcodes);
+
+  return out;
+
+}
@@ -0,0 +1,644 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#ifndef __PHYR_PGLMM_H
+#define __PHYR_PGLMM_H
+
+#include <RcppArmadillo.h>
+#include <vector>
+#include <string>
+#include <functional>
+#include <memory>
+
+using namespace Rcpp;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Classes
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+/*
+ Fill-reducing ordering for sparse Cholesky factorizations of matrices that all
+ have (at most) the nonzeros in `pattern`.
+ It's found once per model fit and reused for every factorization.
+ */
+class SparseCholPattern {
+public:
+  std::vector<int> perm;
+  arma::sp_mat pattern;
+
+  SparseCholPattern() : perm(), pattern() {}
+  SparseCholPattern(const arma::sp_mat& pattern_);
+};
+
+
+/*
+ Sparse LDL' factorization of a symmetric, positive-definite matrix, using the
+ ordering from a `SparseCholPattern` object.
+ `success` is false if the matrix isn't positive definite.
+ Quasi-definite matrices ([A, B; B', -C], with A and C positive definite) can be
+ factorized with any ordering, so these are allowed when `n_negative` (the
+ number of rows in C) is given; `logdet` is then log|det|.
+ The factor's nonzeros include all of the pattern's, even where `A` is zero
+ (e.g., for a variance of zero), so `inverse_subset` always covers them.
+ The implementation (using Eigen) is hidden in `pglmm_sparse.cpp`.
+ */
+class SparseChol {
+public:
+  bool success;
+  double logdet;
+
+  SparseChol(const arma::sp_mat& A, const SparseCholPattern& pattern,
+             const int& n_negative = 0);
+  ~SparseChol();
+
+  arma::mat solve(const arma::mat& B) const;
+  /*
+   Entries of A^-1 at the nonzeros of the factor (and their transposes), from the
+   Takahashi recursion, without forming any other part of A^-1.
+   */
+  arma::sp_mat inverse_subset() const;
+
+private:
+  class Impl;
+  std::unique_ptr<Impl> impl;
+  SparseChol(const SparseChol&);
+  SparseChol& operator=(const SparseChol&);
+};
+
+
+/*
+ Kronecker structure of the nested terms on a complete site x species grid.
+
+ If every nested term is kronecker(S_j, P_j), with S_j (site) and P_j (species)
+ being either identity or covariance matrices, and all S_j (and all P_j) share
+ eigenvectors, then c * I + sum_j sn_j^2 * kronecker(S_j, P_j) =
+ kronecker(Q_site, Q_sp) D kronecker(Q_site, Q_sp)', where D is diagonal.
+ The eigendecompositions are done once per model fit, after which solves cost
+ O(n * (n_site + n_sp)) and the log-determinant is sum(log(D)).
+ The structure comes from the "kron" attribute of the `nested` list
+ (see `get_kron_structure` in R).
+ `ok` is false if there's no such attribute or the factors don't share eigenvectors.
+ */
+class PglmmKron {
+public:
+  bool ok;
+  arma::uvec index;                   // position of each observation in the grid
+  int n_site;
+  int n_sp;
+  arma::mat Q_site;
+  arma::mat Q_sp;
+  std::vector<arma::vec> lambda_site; // eigenvalues of S_j in the basis Q_site
+  std::vector<arma::vec> lambda_sp;   // eigenvalues of P_j in the basis Q_sp
+
+  PglmmKron() : ok(false), index(), n_site(0), n_sp(0), Q_site(), Q_sp(),
+                lambda_site(), lambda_sp() {}
+  PglmmKron(const List& kron);
+
+  /*
+   Eigenvalues (n_sp x n_site) of c * I + sum_j sn(j)^2 * kronecker(S_j, P_j)
+   */
+  arma::mat eigenvalues(const double& c, const arma::vec& sn) const {
+    arma::mat D(n_sp, n_site);
+    D.fill(c);
+    for (unsigned j = 0; j < lambda_site.size(); j++) {
+      D += (sn(j) * sn(j)) * (lambda_sp[j] * lambda_site[j].t());
+    }
+    return D;
+  }
+  // kronecker(Q_site, Q_sp) diag(1 / D) kronecker(Q_site, Q_sp)' * B
+  arma::mat solve(const arma::mat& D, const arma::mat& B) const;
+  // kronecker(Q_site, Q_sp)' * B, with rows in grid order (to match vectorise(D))
+  arma::mat rotate(const arma::mat& B) const;
+};
+
+
+/*
+ A nested term stored as latent variables with a sparse precision matrix, so that
+ its covariance is N = P Q^-1 P', where P maps observations to latent variables.
+ For a phylogeny under Brownian motion, the latent variables are the values at
+ every non-root node, so Q has about three nonzeros per row and the term's size
+ is linear in the number of tips (see `phylo_augmented` in R).
+ `PglmmVinv` factorizes the sparse matrix [A, sn P; sn P', -Q] rather than
+ forming N.
+ */
+class PglmmAugmented {
+public:
+  arma::sp_mat P;
+  arma::sp_mat Q;
+  double logdetQ;
+
+  PglmmAugmented() : P(), Q(), logdetQ(0), cholQ() {}
+  PglmmAugmented(const List& aug);
+
+  // N * B
+  arma::mat times(const arma::mat& B) const;
+
+private:
+  std::shared_ptr<SparseChol> cholQ;
+};
+
+
+/*
+ Products of Zt, X, and a response `y`, weighted by iA = diag(1 / a0).
+ Without nested terms, Ut = D Zt, where D = diag(sr * St), so every quadratic form
+ in the likelihood is one of these blocks reweighted by the current `sr`.
+ With only nested terms that have Kronecker structure (and constant a0), X and `y`
+ are instead rotated into the eigenbasis of V (`KX` and `Ky`), so every quadratic
+ form is a sum over observations weighted by 1 / eigenvalues.
+ */
+class PglmmGram {
+public:
+  bool ok;
+  arma::mat ZZ;     // Zt iA Zt'
+  arma::mat ZX;     // Zt iA X
+  arma::vec Zy;     // Zt iA y
+  arma::mat XX;     // X' iA X
+  arma::vec Xy;     // X' iA y
+  double yy;        // y' iA y
+  double logdetA;
+  arma::vec w;      // diagonal of iA
+  arma::mat KX;     // kronecker(Q_site, Q_sp)' X (Kronecker structure only)
+  arma::vec Ky;     // kronecker(Q_site, Q_sp)' y (Kronecker structure only)
+
+  PglmmGram() : ok(false), ZZ(), ZX(), Zy(), XX(), Xy(), yy(0), logdetA(0), w(),
+                KX(), Ky() {}
+};
+
+
+/*
+ Settings for the matrix-free engine for Gaussian models, used when `ok` is true
+ and the Gram blocks can't be used.
+ iV times a matrix comes from preconditioned conjugate gradients (PCG), and log|V|
+ from stochastic Lanczos quadrature (SLQ), so only products with Zt, St, and the
+ nested terms are needed (see `pglmm_iterative.cpp`).
+ Both are preconditioned by diag(V), which comes from `Z2` and `nested_diag`.
+ The probes for SLQ are regenerated from `seed` at every evaluation, so the
+ objective is a smooth function of the parameters.
+ */
+class PglmmIterative {
+public:
+  bool ok;
+  double tol;                           // relative residual tolerance for PCG
+  int maxit;                            // maximum PCG iterations
+  int n_probes;                         // probe vectors for SLQ
+  int steps;                            // Lanczos steps per probe
+  int seed;                             // seed for the probes
+  arma::sp_mat Z;                       // Zt'
+  arma::sp_mat Z2;                      // Zt' squared elementwise
+  std::vector<arma::vec> nested_diag;   // diagonal of each nested term
+
+  PglmmIterative() : ok(false), tol(0), maxit(0), n_probes(0), steps(0), seed(0),
+                     Z(), Z2(), nested_diag() {}
+};
+
+
+/*
+ Data for the pglmm likelihood functions.
+
+ These are converted from R objects once per model fit, so the likelihood functions
+ don't have to convert (and copy) them on every evaluation.
+ Nothing here uses the R API after construction, so these objects can be used
+ from multiple threads.
+ */
+class PglmmData {
+public:
+  arma::mat X;
+  arma::vec Y;
+  arma::sp_mat Zt;
+  arma::sp_mat St;
+  std::vector<arma::sp_mat> nested;        // empty for augmented terms
+  std::vector<PglmmAugmented> augmented;   // empty for other terms
+  bool REML;
+  // Only used for binomial and poisson models:
+  std::string family;
+  arma::vec totalSize;
+  arma::vec mu;
+  arma::vec H;
+  // Ordering for factorizing A when there are nested terms:
+  SparseCholPattern chol_pattern;
+  // Gram blocks, if `set_gram` has been called:
+  PglmmGram gram;
+  // Kronecker structure of the nested terms, if any:
+  PglmmKron kron;
+  // Matrix-free engine, if `set_iterative` has been called:
+  PglmmIterative iterative;
+
+  PglmmData(const arma::mat& X_, const arma::vec& Y_,
+            const arma::sp_mat& Zt_, const arma::sp_mat& St_,
+            const List& nested_, const bool& REML_,
+            const std::string& family_ = "gaussian",
+            const arma::vec& totalSize_ = arma::vec())
+    : X(X_), Y(Y_), Zt(Zt_), St(St_), nested(nested_.size()),
+      augmented(nested_.size()), REML(REML_), family(family_),
+      totalSize(totalSize_), mu(), H(), chol_pattern(), gram(), kron(),
+      iterative() {
+    for (int j = 0; j < nested_.size(); j++) {
+      SEXP nested_j = nested_[j];
+      if (TYPEOF(nested_j) == VECSXP) {
+        augmented[j] = PglmmAugmented(List(nested_j));
+      } else {
+        nested[j] = as<arma::sp_mat>(nested_j);
+      }
+    }
+    if (nested.size() > 0 && nested_.hasAttribute("kron")) {
+      SEXP kron_ = nested_.attr("kron");
+      if (!Rf_isNull(kron_)) kron = PglmmKron(List(kron_));
+    }
+    // The sparse factorization isn't needed with Kronecker structure, unless
+    // non-constant weights (binomial or poisson models) are added to the diagonal
+    if (nested.size() > 0 && (!kron.ok || family != "gaussian")) {
+      arma::vec ones(n_obs(), arma::fill::ones);
+      chol_pattern = SparseCholPattern(arma::spones(augmented_matrix(ones, ones)));
+    }
+  }
+
+  int q_nonNested() const { return St.n_rows; }
+  int q_Nested() const { return nested.size(); }
+
+  bool is_augmented(const int& j) const { return augmented[j].P.n_rows > 0; }
+  // Number of observations, from the nested terms
+  int n_obs() const {
+    if (is_augmented(0)) return augmented[0].P.n_rows;
+    return nested[0].n_rows;
+  }
+  // Total number of latent variables in augmented terms
+  int n_latent() const {
+    int m = 0;
+    for (unsigned j = 0; j < augmented.size(); j++) m += augmented[j].Q.n_rows;
+    return m;
+  }
+  double logdetQ() const {
+    double out = 0;
+    for (unsigned j = 0; j < augmented.size(); j++) out += augmented[j].logdetQ;
+    return out;
+  }
+  // N_j * B and N_j, for either kind of nested term
+  arma::mat nested_times(const int& j, const arma::mat& B) const {
+    if (is_augmented(j)) return augmented[j].times(B);
+    return nested[j] * B;
+  }
+  arma::mat nested_dense(const int& j) const {
+    if (is_augmented(j)) return augmented[j].times(arma::mat(augmented[j].P.t()));
+    return arma::mat(nested[j]);
+  }
+  /*
+   diag(a0) plus the nested terms weighted by sn^2, with a row and column block
+   [sn P; -Q] for each augmented term (which are after the observations).
+   Without augmented terms, this is just A.
+   */
+  arma::sp_mat augmented_matrix(const arma::vec& a0, const arma::vec& sn) const;
+
+  /*
+   Compute the Gram blocks for iA = diag(1 / a0) and response `y` once, so that
+   likelihood evaluations only reweight them (see `pglmm_gram_forms`).
+   They're only used without nested terms (so that A is diagonal) and when there
+   are fewer random-effect levels than observations, or with only nested terms
+   that have Kronecker structure (see `PglmmGram`).
+   `a0` and `y` must be updated by calling this again whenever they change.
+   */
+  void set_gram(const arma::vec& a0, const arma::vec& y) {
+    gram = PglmmGram();
+    if (q_Nested() > 0 && q_nonNested() == 0 && kron.ok && arma::all(a0 == a0(0))) {
+      gram.KX = kron.rotate(X);
+      gram.Ky = kron.rotate(y);
+      gram.w = 1 / a0;
+      gram.ok = true;
+      return;
+    }
+    if (q_Nested() > 0 || q_nonNested() == 0 || Zt.n_rows >= Zt.n_cols) return;
+    int n = Zt.n_cols;
+    arma::vec w = 1 / a0;
+    arma::sp_mat W(n, n);
+    W.diag() = w;
+    arma::mat wX = X;
+    wX.each_col() %= w;
+    arma::vec wy = y % w;
+    gram.ZZ = arma::mat(Zt * W * Zt.t());
+    gram.ZX = Zt * wX;
+    gram.Zy = Zt * wy;
+    gram.XX = X.t() * wX;
+    gram.Xy = X.t() * wy;
+    gram.yy = arma::dot(y, wy);
+    gram.logdetA = arma::accu(arma::log(a0));
+    gram.w = w;
+    gram.ok = true;
+  }
+
+  /*
+   Replace the response of a Gaussian model, updating only the response blocks
+   of the Gram blocks (if they're used), so that several responses can be fit
+   with the same design.
+   */
+  void set_response(const arma::vec& y) {
+    Y = y;
+    if (!gram.ok) return;
+    if (q_nonNested() == 0) {
+      gram.Ky = kron.rotate(y);
+      return;
+    }
+    arma::vec wy = y % gram.w;
+    gram.Zy = Zt * wy;
+    gram.Xy = X.t() * wy;
+    gram.yy = arma::dot(y, wy);
+  }
+
+  /*
+   Use the matrix-free engine for Gaussian models (see `PglmmIterative`), with
+   PCG tolerance `tol` and at most `maxit` iterations, and `n_probes` probes with
+   `steps` Lanczos steps each for SLQ.
+   Defined in `pglmm_iterative.cpp`.
+   */
+  void set_iterative(const double& tol, const int& maxit, const int& n_probes,
+                     const int& steps, const int& seed);
+
+};
+
+
+/*
+ Output from optimizing variance components.
+ `counts` matches the `counts` output from `stats::optim` for the "Nelder-Mead"
+ and "L-BFGS-B" methods and the `iterations` output from `nloptr::nloptr` otherwise.
+ `convcode` matches `convergence` from `stats::optim` or `status` from `nloptr`.
+ If an error occurred, `error` contains its message; this is used instead of
+ throwing an R error so that optimizing is safe to do from multiple threads.
+ */
+class PglmmOptim {
+public:
+  arma::vec par;
+  double value;
+  int convcode;
+  arma::vec counts;
+  std::string error;
+
+  PglmmOptim() : par(), value(0), convcode(0), counts(), error() {}
+};
+
+typedef std::function<double(const arma::vec&)> pglmm_objective;
+
+
+/*
+ Output from PQL estimation of a binomial or poisson pglmm.
+ As for `PglmmOptim`, `error` contains the message if an error occurred.
+ */
+class PglmmPQL {
+public:
+  arma::mat B;
+  arma::vec ss;
+  arma::vec mu;
+  arma::vec H;
+  double LL;
+  int convcode;
+  arma::vec niter;
+  std::string error;
+
+  PglmmPQL() : B(), ss(), mu(), H(), LL(0), convcode(0), niter(), error() {}
+};
+
+
+/*
+ iV for one set of parameters, kept in factored form.
+
+ V = A + U U', where A = diag(a0) + sum of the nested terms, and U contains the
+ non-nested terms.
+ (For Gaussian models, a0 is all ones; otherwise, it's the inverse of the weights.)
+ With nested terms, A is factorized with a sparse Cholesky decomposition (of the
+ augmented matrix from `PglmmData::augmented_matrix` if there are augmented
+ terms), or diagonalized using `PglmmKron` if it has Kronecker structure and a0
+ is constant.
+ iV is then applied via the Woodbury identity, and log|V| comes from the Sylvester
+ identity, log|V| = log|A| + log|I + U' iA U|, so an n x n inverse is never formed.
+ The diagonal of iV and traces with nested terms use the entries of iA on the
+ nonzeros of its sparse factor (selected inversion), or the eigenvalues with
+ Kronecker structure, rather than all of iA.
+ This doesn't use the R API, so it's safe to use from multiple threads.
+ */
+class PglmmVinv {
+public:
+  double logdetV;
+
+  PglmmVinv(const arma::vec& par, const PglmmData& data, const arma::vec& a0_);
+
+  // iV * B
+  arma::mat times(const arma::mat& B) const;
+  // B' iV B
+  arma::mat quad(const arma::mat& B) const { return B.t() * times(B); }
+  // iV as a dense matrix (only needed for output)
+  arma::mat dense() const {
+    return times(arma::eye<arma::mat>(a0.n_elem, a0.n_elem));
+  }
+  // Diagonal of iV
+  arma::vec diag() const;
+  // tr(iV N_j) for each nested term j of `data` (the data used to make this)
+  arma::vec trace_nested(const PglmmData& data) const;
+
+private:
+  int q_nonNested;
+  int n_latent;                       // rows of `cholA` after the observations
+  arma::vec a0;
+  arma::vec sn;
+  std::shared_ptr<SparseChol> cholA;  // only used for nested terms
+  arma::mat iA_dense;                 // only used if `cholA` fails
+  const PglmmKron* kron;              // only used for Kronecker structure
+  arma::mat kron_D;
+  arma::sp_mat Ut;
+  arma::mat iA_U;
+  arma::mat M;                        // I + U' iA U
+  arma::mat M_chol;
+  bool M_chol_ok;
+
+  arma::mat iA_times(const arma::mat& B) const;
+  arma::mat M_solve(const arma::mat& B) const;
+};
+
+
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Functions
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+// --------------
+// pglmm_sparse.cpp
+// --------------
+
+// (`SparseCholPattern`, `SparseChol`, and `PglmmVinv` methods)
+
+/*
+ X' iV X, X' iV y, y' iV y, and log|V| from the Gram blocks in `data.gram`, using
+ only products of size (number of random-effect levels)^2.
+ */
+void pglmm_gram_forms(const arma::vec& par, const PglmmData& data,
+                      arma::mat& XiVX, arma::vec& XiVy, double& yiVy,
+                      double& logdetV);
+
+
+// --------------
+// pglmm_iterative.cpp
+// --------------
+
+// V * B for a Gaussian pglmm (without the residual variance), from products only
+arma::mat pglmm_iterative_V_times(const arma::vec& par, const PglmmData& data,
+                                  const arma::mat& B);
+
+// iV * B for a Gaussian pglmm by PCG, using `data.iterative`
+arma::mat pglmm_iterative_solve(const arma::vec& par, const PglmmData& data,
+                                const arma::mat& B);
+
+// log|V| for a Gaussian pglmm by SLQ, using `data.iterative`
+double pglmm_iterative_logdet(const arma::vec& par, const PglmmData& data);
+
+
+// --------------
+// pglmm_gaussian.cpp
+// --------------
+
+// Gaussian pglmm log likelihood function (without constants)
+double pglmm_gaussian_LL_core(const arma::vec& par, const PglmmData& data);
+
+// Output from a Gaussian pglmm at parameters `par`
+List pglmm_gaussian_LL_calc_core(const arma::vec& par, const PglmmData& data);
+
+// GLS estimates of B, their covariance, and s2resid for a Gaussian pglmm at `par`
+void pglmm_gaussian_gls(const arma::vec& par, const PglmmData& data,
+                        arma::vec& B, arma::mat& B_cov, double& s2resid);
+
+/*
+ Optimize variance components for a Gaussian pglmm, starting from `par0`, with
+ `optimizer` being "ai-reml" or any method for `pglmm_optimize`.
+ Verbose output is up to the caller's `fn`.
+ */
+PglmmOptim pglmm_gaussian_optimize(const pglmm_objective& fn,
+                                   const arma::vec& par0,
+                                   const PglmmData& data,
+                                   const std::string& optimizer,
+                                   const int& maxit,
+                                   const double& reltol,
+                                   const bool& use_lbfgsb);
+
+/*
+ Optimize variance components for a Gaussian pglmm using average-information
+ (AI) REML, or the same scoring algorithm for ML if `data.REML` is false.
+ `fn` should evaluate `pglmm_gaussian_LL_core` and is used to check each step.
+ */
+PglmmOptim pglmm_gaussian_ai(const pglmm_objective& fn,
+                             const arma::vec& par0,
+                             const PglmmData& data,
+                             const int& maxit,
+                             const double& reltol);
+
+
+// --------------
+// pglmm_binary.cpp
+// --------------
+
+// Diagonal of A without nested terms for a binomial or poisson pglmm
+arma::vec pglmm_inv_weights(const PglmmData& data);
+
+// iV and (optionally) log|V| for a binomial or poisson pglmm, using `data.mu`
+void pglmm_iV_logdetV_core(const arma::vec& par, const PglmmData& data,
+                           const bool& logdet, arma::sp_mat& iV, double& logdetV);
+
+// Binomial or poisson pglmm log likelihood function, using `data.mu` and `data.H`
+double pglmm_LL_core(const arma::vec& par, const PglmmData& data);
+
+// V for a binomial or poisson pglmm, without the weights if `missing_mu` is true
+// (augmented terms are made dense, so this is only for output)
+arma::sp_mat pglmm_V_core(const arma::vec& par, const PglmmData& data,
+                          const bool& missing_mu);
+
+// (diag(a0) + U U' + sum_j sn_j^2 N_j) * B, from products only
+arma::mat pglmm_V_times(const arma::vec& par, const PglmmData& data,
+                        const arma::mat& B, const arma::vec& a0);
+
+/*
+ Profile likelihoods for dropping each random term of a binomial or poisson
+ pglmm, using `data.mu`, `data.H`, and the Gram blocks for them.
+ */
+List pglmm_profile_LRT_core(const arma::vec& par, const PglmmData& data,
+                            const bool& reoptimize, const std::string& optimizer,
+                            const int& maxit, const double& reltol,
+                            const int& n_threads);
+
+/*
+ PQL estimation of a binomial or poisson pglmm, using `data.Y`.
+ This is safe to call from multiple threads unless `main_thread` is true.
+ With `n_threads > 1`, "Nelder-Mead" evaluates candidate points in parallel
+ (see `pglmm_optimize_parallel`).
+ */
+PglmmPQL pglmm_pql_core(PglmmData& data, const arma::mat& B_init,
+                        const arma::vec& ss, const std::string& optimizer,
+                        const int& maxit, const double& reltol,
+                        const double& tol_pql, const double& maxit_pql,
+                        const bool& verbose, const bool& main_thread,
+                        const int& n_threads = 1);
+
+
+// --------------
+// pglmm_optim.cpp
+// --------------
+
+/*
+ Optimize variance components using the method `optimizer` ("Nelder-Mead",
+ "bobyqa", "nelder-mead-nlopt", or "subplex").
+ If `use_lbfgsb` is `true` and `optimizer == "Nelder-Mead"`, the L-BFGS-B
+ method is used instead of Nelder-Mead (as is done with one random effect).
+ This is safe to call from multiple threads unless L-BFGS-B is used.
+ For the nlopt methods, `pglmm_nlopt_prime` must have been called first from the
+ main thread.
+ */
+PglmmOptim pglmm_optimize(const pglmm_objective& fn,
+                          const arma::vec& par0,
+                          const std::string& optimizer,
+                          const int& maxit,
+                          const double& reltol,
+                          const bool& use_lbfgsb);
+
+/*
+ Look up all the nlopt functions that `pglmm_optimize` uses. nloptr's C API does
+ this lazily using the R API, so call this from the main thread before using
+ an nlopt method from other threads.
+ */
+void pglmm_nlopt_prime();
+
+/*
+ Optimize variance components with Nelder-Mead (as for `pglmm_optimize`), but
+ evaluating candidate points on several threads, each using one of `fns`.
+ The results are the same as from `pglmm_optimize` with one of `fns`.
+ `fns` should all evaluate the same function, each with its own copy of the data,
+ and `fns[0]` is only called from the calling thread.
+ */
+PglmmOptim pglmm_optimize_parallel(const std::vector<pglmm_objective>& fns,
+                                   const arma::vec& par0,
+                                   const int& maxit,
+                                   const double& reltol);
+
+// Print value and parameters from an evaluation when `verbose = TRUE`
+inline void pglmm_print_eval(const double& LL, const arma::vec& par) {
+  Rcout << LL;
+  for (unsigned i = 0; i < par.n_elem; i++) Rcout << " " << par(i);
+  Rcout << std::endl;
+  return;
+}
+
+
+#endif
@@ -8,107 +8,49 @@
 //
 // [[Rcpp::depends(RcppArmadillo)]]
 
+#include "pglmm.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace Rcpp;
 using namespace arma;
 
+/*
+ Diagonal of A without nested terms (the inverse of the weights) for a binomial or
+ poisson pglmm, using `data.mu` for the current mean.
+ */
+arma::vec pglmm_inv_weights(const PglmmData& data) {
+  if (data.family == "poisson") return 1 / data.mu;
+  return 1 / (data.totalSize % data.mu % (1 - data.mu));
+}
+
+/*
+ iV and (if `logdet`) log|V| for a binomial or poisson pglmm from preconverted data,
+ using `data.mu` for the current mean.
+ This doesn't use the R API, so it's safe to call from multiple threads.
+ */
+void pglmm_iV_logdetV_core(const arma::vec& par, const PglmmData& data,
+                           const bool& logdet, arma::sp_mat& iV0, double& logdetV){
+  // Only the output needs iV as a dense matrix
+  const PglmmVinv Vinv(par, data, pglmm_inv_weights(data));
+  iV0 = arma::sp_mat(Vinv.dense());
+  if (logdet) logdetV = Vinv.logdetV;
+  
+  return;
+}
+
 // [[Rcpp::export]]
 List pglmm_iV_logdetV_cpp(NumericVector par, arma::vec mu,
                                 const arma::sp_mat& Zt, const arma::sp_mat& St, 
                                 const List& nested, bool logdet,
                                 const std::string family, arma::vec totalSize){
-  int q_nonNested = St.n_rows;
-  arma::sp_mat Ut;
-  arma::sp_mat U;
-  if(q_nonNested > 0){
-    IntegerVector idx = seq_len(q_nonNested) - 1; // c++ starts with 0
-    // uvec idx_uvec = as<uvec>(idx);
-    NumericVector sr0 = par[idx];
-    rowvec sr = real(as<rowvec>(sr0));
-    arma::mat iC0 = sr * St;
-    arma::vec iC1 = vectorise(iC0, 0); // extract by columns
-    arma::sp_mat iC = sp_mat(diagmat(iC1));
-    Ut = iC * Zt;
-    U = trans(Ut);
-  }
-  
-  int q_Nested = nested.size();
-  
-  NumericVector sn; // pre-declare out of if{}
-  if (q_Nested > 0) {
-    IntegerVector idx2 = wrap(seq(q_nonNested, q_nonNested + q_Nested - 1));
-    NumericVector sn0 = par[idx2];
-    rowvec sn1 = real(as<rowvec>(sn0));
-    sn = as<NumericVector>(wrap(sn1)); // no need to declare type again
-  } 
-  
+  PglmmData data(arma::mat(), arma::vec(), Zt, St, nested, false, family, totalSize);
+  data.mu = mu;
   arma::sp_mat iV0;
-  arma::mat Ishort_Ut_iA_U;
   double logdetV;
-  double signV;
-  double logdetiA;
-  double signiA;
-  if (q_Nested == 0){ // then q_nonNested will not be 0, otherwise, no random terms
-    arma::vec pq = totalSize % mu % (1 - mu);
-    arma::sp_mat iA;
-    if(family == "binomial") iA = sp_mat(diagmat(pq));
-    if(family == "poisson") iA = sp_mat(diagmat(mu));
-    arma::sp_mat Ishort = sp_mat(Ut.n_rows, Ut.n_rows); Ishort.eye();
-    arma::sp_mat Ut_iA_U = Ut * iA * U;
-    // Woodbury identity
-    Ishort_Ut_iA_U = mat(Ishort + Ut_iA_U);
-    arma::mat i_Ishort_Ut_iA_U = inv(Ishort_Ut_iA_U);
-    iV0 = iA - iA * U * sp_mat(i_Ishort_Ut_iA_U) * Ut * iA;
-    arma::mat iV(iV0); // convert to dense matrix
-    if(logdet){
-      log_det(logdetV, signV, Ishort_Ut_iA_U); 
-      log_det(logdetiA, signiA, mat(iA)); 
-      logdetV = logdetV - logdetiA;
-      NumericVector logdetV1 = NumericVector::create(logdetV);
-      if(any(is_infinite(logdetV1))){
-        arma::mat lgm = chol(Ishort_Ut_iA_U);
-        logdetV = 2 * sum(log(lgm.diag())) - logdetiA;
-      }
-    }
-  } else {
-    arma::vec pq = 1 / (totalSize % mu % (1 - mu));
-    arma::sp_mat A;
-    if(family == "binomial") A = sp_mat(diagmat(pq));
-    if(family == "poisson") A = sp_mat(diagmat(1 / mu));
-    if (q_Nested == 1){
-      double snj = pow(sn[0], 2);
-      sp_mat nj = nested[0];
-      A = A + snj * nj;
-    } else {
-      for (int j = 0; j < q_Nested; j++) {
-        double snj = pow(sn[j], 2);
-        sp_mat nj = nested[j];
-        A = A + snj * nj;
-      }
-    }
-    arma::mat A1(A);
-    arma::sp_mat iA = sp_mat(inv(A1));
-    // Rcout << iA << " " ;
-    if(q_nonNested > 0){
-      arma::sp_mat Ishort = sp_mat(Ut.n_rows, Ut.n_rows); Ishort.eye();
-      arma::sp_mat Ut_iA_U = Ut * iA * U;
-      Ishort_Ut_iA_U = mat(Ishort + Ut_iA_U);
-      arma::mat i_Ishort_Ut_iA_U = inv(Ishort_Ut_iA_U);
-      iV0 = iA - iA * U * sp_mat(i_Ishort_Ut_iA_U) * Ut * iA;
-    } else {
-      iV0 = iA;
-    }
-    
-    arma::mat iV(iV0); // convert to dense matrix
-    if(logdet){
-      log_det(logdetV, signV, iV); 
-      logdetV = -1 * logdetV;
-      NumericVector logdetV1 = NumericVector::create(logdetV);
-      if(any(is_infinite(logdetV1))){
-        arma::mat lgm = chol(iV);
-        logdetV = -2 * sum(log(lgm.diag()));
-      }
-    }
-  }
+  pglmm_iV_logdetV_core(as<arma::vec>(par), data, logdet, iV0, logdetV);
   
   if(logdet){
     return List::create(
@@ -120,18 +62,23 @@ List pglmm_iV_logdetV_cpp(NumericVector par, arma::vec mu,
   }
 }
 
-// [[Rcpp::export]]
-arma::sp_mat pglmm_V(NumericVector par, const arma::sp_mat& Zt, 
-                           const arma::sp_mat& St, arma::vec mu, 
-                           const List& nested, bool missing_mu,
-                           const std::string family, arma::vec totalSize){
-  int q_nonNested = St.n_rows;
+/*
+ V for a binomial or poisson pglmm from preconverted data, using `data.mu`
+ unless `missing_mu` is true.
+ For a Gaussian pglmm, this is V(par) (with unit residual variance).
+ Augmented nested terms are made dense here, so this should only be used to
+ output V; use `pglmm_V_times` for products with V.
+ */
+arma::sp_mat pglmm_V_core(const arma::vec& par, const PglmmData& data,
+                          const bool& missing_mu){
+  const arma::sp_mat& Zt(data.Zt);
+  const arma::sp_mat& St(data.St);
+  const std::string& family(data.family);
+  int q_nonNested = data.q_nonNested();
   arma::sp_mat Ut;
   arma::sp_mat U;
   if(q_nonNested > 0){
-    IntegerVector idx = seq_len(q_nonNested) - 1; // c++ starts with 0
-    NumericVector sr0 = par[idx];
-    rowvec sr = real(as<rowvec>(sr0));
+    rowvec sr = trans(par.subvec(0, q_nonNested - 1));
     arma::mat iC0 = sr * St;
     arma::vec iC1 = vectorise(iC0, 0); // extract by columns
     arma::sp_mat iC = sp_mat(diagmat(iC1));
@@ -139,36 +86,29 @@ arma::sp_mat pglmm_V(NumericVector par, const arma::sp_mat& Zt,
     U = trans(Ut);
   }
   
-  int q_Nested = nested.size();
-  NumericVector sn; // pre-declare out of if{}
+  int q_Nested = data.q_Nested();
+  arma::vec sn; // pre-declare out of if{}
   if (q_Nested > 0) {
-    IntegerVector idx2 = wrap(seq(q_nonNested, q_nonNested + q_Nested - 1));
-    NumericVector sn0 = par[idx2];
-    rowvec sn1 = real(as<rowvec>(sn0));
-    sn = as<NumericVector>(wrap(sn1)); // no need to declare type again
+    sn = par.subvec(q_nonNested, q_nonNested + q_Nested - 1);
   } 
   
-  arma::mat iW;
-  if(missing_mu){
-    iW = mat(Zt.n_cols, Zt.n_cols, fill::zeros);
-  } else {
-    arma::vec pq = 1 / (totalSize % mu % (1 - mu));
-    if(family == "binomial") iW = diagmat(pq);
-    if(family == "poisson") iW = diagmat(1 / mu);
+  // Inverse weights on the diagonal (ones for Gaussian models)
+  int n = (q_Nested > 0) ? data.n_obs() : Zt.n_cols;
+  arma::sp_mat A(n, n);
+  if(!missing_mu){
+    if(family == "gaussian") {
+      A.diag() = arma::vec(n, fill::ones);
+    } else {
+      A.diag() = pglmm_inv_weights(data);
+    }
   }
   
-  arma::sp_mat A = sp_mat(iW);
-  if(q_Nested > 0){
-    if (q_Nested == 1){
-      double snj = pow(sn[0], 2);
-      sp_mat nj = nested[0];
-      A = A + snj * nj;
+  for (int j = 0; j < q_Nested; j++) {
+    double snj = pow(sn(j), 2);
+    if (data.is_augmented(j)) {
+      A = A + snj * arma::sp_mat(data.nested_dense(j));
     } else {
-      for (int j = 0; j < q_Nested; j++) {
-        double snj = pow(sn[j], 2);
-        sp_mat nj = nested[j];
-        A = A + snj * nj;
-      }
+      A = A + snj * data.nested[j];
     }
   }
   
@@ -182,50 +122,211 @@ arma::sp_mat pglmm_V(NumericVector par, const arma::sp_mat& Zt,
   return V;
 }
 
+/*
+ V * B, where the diagonal of V is `a0` plus that of the random terms, without
+ forming V: the non-nested terms are Zt' (d^2 % (Zt B)) for d = sr * St, and
+ the nested terms (including augmented ones) only need products.
+ Memory is linear in the number of observations (for a few columns in `B`).
+ This doesn't use the R API, so it's safe to call from multiple threads.
+ */
+arma::mat pglmm_V_times(const arma::vec& par, const PglmmData& data,
+                        const arma::mat& B, const arma::vec& a0) {
+  int q_nonNested = data.q_nonNested();
+  arma::mat VB = B;
+  VB.each_col() %= a0;
+  if (q_nonNested > 0) {
+    arma::vec d2 = square(vectorise(trans(par.head(q_nonNested)) * data.St));
+    arma::mat ZtB = data.Zt * B;
+    ZtB.each_col() %= d2;
+    if (data.iterative.ok) {
+      VB += data.iterative.Z * ZtB;
+    } else {
+      VB += trans(data.Zt) * ZtB;
+    }
+  }
+  for (int j = 0; j < data.q_Nested(); j++) {
+    double sn = par(q_nonNested + j);
+    VB += (sn * sn) * data.nested_times(j, B);
+  }
+  return VB;
+}
+
+// [[Rcpp::export]]
+arma::sp_mat pglmm_V(NumericVector par, const arma::sp_mat& Zt, 
+                           const arma::sp_mat& St, arma::vec mu, 
+                           const List& nested, bool missing_mu,
+                           const std::string family, arma::vec totalSize){
+  PglmmData data(arma::mat(), arma::vec(), Zt, St, nested, false, family, totalSize);
+  data.mu = mu;
+  return pglmm_V_core(as<arma::vec>(par), data, missing_mu);
+}
+
+/*
+ Binomial or poisson pglmm log likelihood function from preconverted data,
+ using `data.mu` and `data.H`.
+ This doesn't use the R API, so it's safe to call from multiple threads.
+ */
+double pglmm_LL_core(const arma::vec& par_, const PglmmData& data){
+  arma::vec par = abs(par_);
+  const arma::mat& X(data.X);
+  const arma::vec& H(data.H);
+  double LL;
+  if (data.gram.ok) {
+    // Only reweight the precomputed Gram blocks (with y = H)
+    arma::mat XiVX;
+    arma::vec XiVH;
+    double HiVH, logdetV;
+    pglmm_gram_forms(par, data, XiVX, XiVH, HiVH, logdetV);
+    LL = 0.5 * (logdetV + HiVH);
+    if (data.REML) {
+      double logdetL, signL;
+      log_det(logdetL, signL, XiVX);
+      LL += 0.5 * logdetL;
+    }
+    return LL;
+  }
+  // iV in factored form
+  const PglmmVinv Vinv(par, data, pglmm_inv_weights(data));
+  if (data.REML) {
+    double logdetL, signL;
+    log_det(logdetL, signL, Vinv.quad(X));
+    LL = 0.5 * (Vinv.logdetV + as_scalar(Vinv.quad(H)) + logdetL);
+  } else {
+    LL = 0.5 * (Vinv.logdetV + as_scalar(Vinv.quad(H)));
+  }
+  
+  return LL;
+}
+
 // [[Rcpp::export]]
 double pglmm_LL_cpp(NumericVector par, const arma::vec& H,
                           const arma::mat& X, const arma::sp_mat& Zt, 
                           const arma::sp_mat& St, const arma::vec& mu, 
                           const List& nested, bool REML, bool verbose,
                           const std::string family, arma::vec totalSize){
-  par = abs(par);
-  // unsigned int n = H.n_rows;
-  List iVdet = pglmm_iV_logdetV_cpp(par, mu, Zt, St, nested, true, family, totalSize);
-  sp_mat iV0 = as<sp_mat>(iVdet["iV"]);
-  mat iV = mat(iV0);
-  double logdetV = iVdet["logdetV"];
-  double LL;
-  if (REML) {
-    double logdetL, signL;
-    log_det(logdetL, signL, trans(X) * iV * X);
-    LL = 0.5 * (logdetV + as_scalar(trans(H) * iV * H) + logdetL);
-  } else {
-    LL = 0.5 * (logdetV + as_scalar(trans(H) * iV * H));
-  }
+  PglmmData data(X, arma::vec(), Zt, St, nested, REML, family, totalSize);
+  data.mu = mu;
+  data.H = H;
+  double LL = pglmm_LL_core(as<arma::vec>(par), data);
   
-  if (verbose) Rcout << LL << " " << par << std::endl;
+  if (verbose) {
+    NumericVector par_abs = abs(par);
+    Rcout << LL << " " << par_abs << std::endl;
+  }
   
   return LL;
 }
 
 
+/*
+ Profile likelihoods for dropping each random term of a fitted binomial or poisson
+ pglmm, holding `data.mu` and `data.H` at their fitted values (as
+ `pglmm_profile_LRT` does), which should also have been used for `data.set_gram`.
+
+ `LL0(j)` is the likelihood function with `par(j) = 0`, either at the fitted values
+ of the other terms or, if `reoptimize` is true, minimized over the other terms
+ starting from their fitted values.
+ The terms are done in parallel.
+ */
+List pglmm_profile_LRT_core(const arma::vec& par, const PglmmData& data,
+                            const bool& reoptimize, const std::string& optimizer,
+                            const int& maxit, const double& reltol,
+                            const int& n_threads){
+  
+  const arma::vec par_full = abs(par);
+  int q = par_full.n_elem;
+  double LL = pglmm_LL_core(par_full, data);
+  
+  arma::vec LL0(q);
+  LL0.fill(datum::nan);
+  std::vector<int> convcodes(q, 0);
+  std::vector<std::string> errors(q);
+  
+  int n_thr = std::max(n_threads, 1);
+  // nlopt functions are looked up with the R API, so it's done here
+  if (reoptimize && n_thr > 1) pglmm_nlopt_prime();
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_thr)
+#endif
+  for (int j = 0; j < q; j++) {
+    try {
+      arma::uvec others(q - 1);
+      for (int i = 0, k = 0; i < q; i++) if (i != j) others(k++) = i;
+      // Likelihood function of the other terms, with term `j` set to zero
+      pglmm_objective fn = [&data, &par_full, &others, j](const arma::vec& par_) {
+        arma::vec par_j = par_full;
+        par_j(j) = 0;
+        par_j.elem(others) = par_;
+        return pglmm_LL_core(par_j, data);
+      };
+      arma::vec par0 = par_full.elem(others);
+      if (reoptimize && q > 1) {
+        PglmmOptim opt = pglmm_optimize(fn, par0, optimizer, maxit, reltol, false);
+        if (!opt.error.empty()) {
+          errors[j] = opt.error;
+        } else {
+          LL0(j) = opt.value;
+          convcodes[j] = opt.convcode;
+        }
+      } else {
+        LL0(j) = fn(par0);
+      }
+    } catch (std::exception& e) {
+      errors[j] = e.what();
+    }
+  }
+  
+  return List::create(_["LL"] = LL, _["LL0"] = LL0,
+                      _["convcode"] = convcodes, _["error"] = errors);
+}
+
 // [[Rcpp::export]]
-List pglmm_internal_cpp(const arma::mat& X, const arma::vec& Y,
-                               const arma::sp_mat& Zt, const arma::sp_mat& St,
-                               const List& nested, const bool REML, const bool verbose,
-                               const int n, const int p, const int q, const int maxit, 
-                               const double reltol, const double tol_pql, const double maxit_pql,
-                               const std::string optimizer, arma::mat B_init, arma::vec ss,
-                               const std::string family, arma::vec totalSize){
-  Rcpp::checkUserInterrupt();
+List pglmm_profile_LRT_cpp(NumericVector par, const arma::vec& H,
+                           const arma::mat& X, const arma::sp_mat& Zt, 
+                           const arma::sp_mat& St, const arma::vec& mu, 
+                           const List& nested, bool REML,
+                           const std::string family, arma::vec totalSize,
+                           bool reoptimize, std::string optimizer, int maxit,
+                           double reltol, int n_threads){
+  
+  PglmmData data(X, arma::vec(), Zt, St, nested, REML, family, totalSize);
+  data.mu = mu;
+  data.H = H;
+  data.set_gram(pglmm_inv_weights(data), H);
+  
+  return pglmm_profile_LRT_core(as<arma::vec>(par), data, reoptimize, optimizer,
+                                maxit, reltol, n_threads);
+}
+
+/*
+ PQL estimation of a binomial or poisson pglmm from preconverted data, starting
+ from `B_init` and `ss`.
+ `data.mu` and `data.H` are updated in place.
+ Errors are stored in the output's `error` instead of being thrown.
+ Unless `main_thread` is true, this doesn't use the R API (and `verbose` is
+ ignored), so it's safe to call from multiple threads.
+ */
+PglmmPQL pglmm_pql_core(PglmmData& data, const arma::mat& B_init,
+                        const arma::vec& ss, const std::string& optimizer,
+                        const int& maxit, const double& reltol,
+                        const double& tol_pql, const double& maxit_pql,
+                        const bool& verbose, const bool& main_thread,
+                        const int& n_threads){
+  
+  PglmmPQL out;
+  
+  const arma::mat& X(data.X);
+  const arma::vec& Y(data.Y);
+  const arma::vec& totalSize(data.totalSize);
+  const std::string& family(data.family);
+  int n = X.n_rows;
+  bool print = verbose && main_thread;
+  
   mat B = B_init;
-  mat b(n, 1, fill::zeros);
-  mat beta = join_vert(B, b);
+  vec b(n, fill::zeros);
   vec mu;
   if(family == "binomial") mu = arma::exp(X * B) / (1 + arma::exp(X * B));
   if(family == "poisson") mu = arma::exp(X * B);
-  mat ix(n, n, fill::eye);
-  mat XX = join_horiz(X, ix);
   
   vec est_ss = ss;
   vec est_B = B;
@@ -236,134 +337,143 @@ List pglmm_internal_cpp(const arma::mat& X, const arma::vec& Y,
   
   unsigned int iteration = 0, iteration_m;
   double tol_pql2 = pow(tol_pql, 2);
-  double LL;
   
-  NumericVector ss0 = wrap(ss); // to work with other functions
-  vec Z, H, niter;
-  int convcode;
-  mat iV;
+  arma::vec ss0 = ss;
+  vec Z, H;
+  out.LL = 0;
+  out.convcode = 0;
   
-  Rcpp::Environment stats("package:stats");
-  Rcpp::Function optim = stats["optim"];
-  Rcpp::Environment nloptr_pkg = Rcpp::Environment::namespace_env("nloptr");
-  Rcpp::Function nloptr = nloptr_pkg["nloptr"];
-  Rcpp::Environment phyr_pkg = Rcpp::Environment::namespace_env("phyr");
-  Rcpp::Function pglmm_LL_cpp2 = phyr_pkg["pglmm_LL_cpp"];
+  pglmm_objective fn = [&data, print](const arma::vec& par_) {
+    double LL_ = pglmm_LL_core(par_, data);
+    if (print) pglmm_print_eval(LL_, abs(par_));
+    return LL_;
+  };
   
-  while((as_scalar(trans(est_ss - oldest_ss) * (est_ss - oldest_ss)) > tol_pql2 ||
-        as_scalar(trans(est_B - oldest_B) * (est_B - oldest_B)) > tol_pql2) &&
-        iteration <= maxit_pql){
-    oldest_ss = est_ss;
-    oldest_B = est_B;
-    vec est_B_m = B;
-    mat oldest_B_m(size(est_B));
-    oldest_B_m.fill(1000000.0);
-    iteration_m = 0;
-    Rcpp::checkUserInterrupt();
-    
-    // mean component
-    while(as_scalar(trans(est_B_m - oldest_B_m) * (est_B_m - oldest_B_m)) > tol_pql2 &&
-          iteration_m <= maxit_pql){
-      // Rcpp::checkUserInterrupt();
-      oldest_B_m = est_B_m;
-      List iv = pglmm_iV_logdetV_cpp(ss0, mu, Zt, St, nested, false, family, totalSize);
-      sp_mat iV0 = iv["iV"];
-      if(family == "binomial") Z = X * B + b + (Y/totalSize - mu)/(mu % (1 - mu));
-      if(family == "poisson") Z = X * B + b + (Y - mu)/mu;
+  try {
+    while((as_scalar(trans(est_ss - oldest_ss) * (est_ss - oldest_ss)) > tol_pql2 ||
+          as_scalar(trans(est_B - oldest_B) * (est_B - oldest_B)) > tol_pql2) &&
+          iteration <= maxit_pql){
+      oldest_ss = est_ss;
+      oldest_B = est_B;
+      vec est_B_m = B;
+      mat oldest_B_m(size(est_B));
+      oldest_B_m.fill(1000000.0);
+      iteration_m = 0;
+      if (main_thread) Rcpp::checkUserInterrupt();
       
-      iV = mat(iV0); // convert to dense matrix
-      arma::mat denom = trans(X) * iV * X;
-      arma::mat num = trans(X) * iV * Z;
-      B = solve(denom, num);
+      // mean component
+      while(as_scalar(trans(est_B_m - oldest_B_m) * (est_B_m - oldest_B_m)) > tol_pql2 &&
+            iteration_m <= maxit_pql){
+        oldest_B_m = est_B_m;
+        data.mu = mu;
+        arma::vec diav = pglmm_inv_weights(data);
+        const PglmmVinv Vinv(ss0, data, diav);
+        if(family == "binomial") Z = X * B + b + (Y/totalSize - mu)/(mu % (1 - mu));
+        if(family == "poisson") Z = X * B + b + (Y - mu)/mu;
+        
+        arma::mat iV_X = Vinv.times(X);
+        arma::mat denom = trans(X) * iV_X;
+        arma::mat num = trans(iV_X) * Z;
+        B = solve(denom, num);
+        
+        // b = C iV (Z - X B), with C = V - diag(diav) applied as a product
+        b = pglmm_V_times(ss0, data, Vinv.times(Z - X * B), arma::vec(n, fill::zeros));
+        // the linear predictor is X * B + b
+        arma::vec eta = X * B + b;
+        if(family == "binomial") mu = arma::exp(eta) / (1 + arma::exp(eta));
+        if(family == "poisson") mu = arma::exp(eta);
+        
+        est_B_m = B;
+        if(print) Rcout << "mean part: " << iteration_m << " " << trans(B) << std::endl;
+        ++iteration_m;
+        if(B.has_nan()) {
+          out.error = "Estimation of B failed. Check for lack of variation in Y. You could try with a smaller s2.init, but this might not help.";
+          return out;
+        }
+      } // end while for mean
       
-      sp_mat V = pglmm_V(ss0, Zt, St, mu, nested, false, family, totalSize);
-      vec diav = vectorise(1/(totalSize % mu % (1 - mu)));
-      sp_mat iW;
-      if(family == "binomial") iW = sp_mat(diagmat(diav));
-      if(family == "poisson") iW = sp_mat(diagmat(1/mu));
-      sp_mat C = V - iW;
-      b = mat(C) * mat(iV) * (Z - X * B);
-      beta = join_vert(B, b);
-      if(family == "binomial") mu = arma::exp(XX * beta) / (1 + arma::exp(XX * beta));
-      if(family == "poisson") mu = arma::exp(XX * beta);
+      // variance component
+      if(family == "binomial") Z = X * B + b + (Y/totalSize - mu)/(mu % (1 - mu)); // B, b, mu all updated
+      if(family == "poisson") Z = X * B + b + (Y - mu)/mu;
+      H = Z - X * B;
+      data.mu = mu;
+      data.H = H;
+      // `mu` and `H` are fixed while optimizing, so so are the Gram blocks
+      data.set_gram(pglmm_inv_weights(data), H);
       
-      est_B_m = B;
-      if(verbose) Rcout << "mean part: " << iteration_m << " " << trans(B) << std::endl;
-      ++iteration_m;
-      // Rcout << "mean part: " << iteration_m << " " << trans(B) << std::endl;
-      // Rcout << "            denom: " << denom << endl;
-      // Rcout << "            num: " << num << endl;
-      if(B.has_nan()) Rcpp::stop("Estimation of B failed. Check for lack of variation in Y. You could try with a smaller s2.init, but this might not help.");
-    } // end while for mean
-    
-    // variance component
-    if(family == "binomial") Z = X * B + b + (Y/totalSize - mu)/(mu % (1 - mu)); // B, b, mu all updated
-    if(family == "poisson") Z = X * B + b + (Y - mu)/mu;
-    H = Z - X * B;
-   
-    Rcpp::List opt;
-    if(optimizer == "Nelder-Mead"){
-      if(q > 1){
-        opt = optim(_["par"] = ss0,
-                    _["fn"] = pglmm_LL_cpp2,
-                    _["H"] = H, _["X"] = X, _["Zt"] = Zt,
-                    _["St"] = St, _["mu"] = mu, _["nested"] = nested,
-                      _["REML"] = REML, _["verbose"] = verbose,
-                      _["family"] = family, _["totalSize"] = totalSize,
-                      _["method"] = "Nelder-Mead",
-                      _["control"] = List::create(_["maxit"] = maxit, _["reltol"] = reltol));
+      PglmmOptim opt;
+      if (n_threads > 1 && optimizer == "Nelder-Mead") {
+        // Other threads evaluate candidate points using their own copies (with
+        // the current `mu`, `H`, and Gram blocks)
+        std::vector<PglmmData> thread_data(n_threads - 1, data);
+        std::vector<pglmm_objective> fns(1, fn);
+        for (const PglmmData& d : thread_data) {
+          fns.push_back([&d](const arma::vec& par_) { return pglmm_LL_core(par_, d); });
+        }
+        opt = pglmm_optimize_parallel(fns, ss0, maxit, reltol);
       } else {
-        // opt = optim(_["par"] = ss0,
-        //             _["fn"] = Rcpp::InternalFunction(&plmm_binary_LL_cpp),
-        //             _["X"] = X, _["H"] = H, _["Zt"] = Zt,
-        //             _["St"] = St, _["nested"] = nested,
-        //             _["mu"] = mu, _["REML"] = REML, _["verbose"] = verbose,
-        //               _["method"] = "L-BFGS-B",
-        //               _["control"] = List::create(_["maxit"] = maxit, _["factr"] = reltol));
-        Rcpp::stop("With only 1 random term and cpp = TRUE, phyr cannot run the optimization yet. \n \
-                     Set optimizer to other options, e.g. nelder-mead-nlopt and re-run it. \n \
-                     Or you can turn cpp off with cpp = FALSE and re-run it.");
+        opt = pglmm_optimize(fn, ss0, optimizer, maxit, reltol, false);
+      }
+      data.gram = PglmmGram();
+      if (!opt.error.empty()) {
+        out.error = opt.error;
+        return out;
       }
-    } else {
-      std::string nlopt_algor;
-      if (optimizer == "bobyqa") nlopt_algor = "NLOPT_LN_BOBYQA";
-      if (optimizer == "nelder-mead-nlopt") nlopt_algor = "NLOPT_LN_NELDERMEAD";
-      if (optimizer == "subplex") nlopt_algor = "NLOPT_LN_SBPLX";
-      List opts = List::create(_["algorithm"] = nlopt_algor,
-                               _["ftol_rel"] = reltol, _["ftol_abs"] = reltol,
-                               _["xtol_rel"] = 0.0001,
-                               _["maxeval"] = maxit);
-      List S0 = nloptr(_["x0"] = ss0,
-                       _["eval_f"] = pglmm_LL_cpp2,
-                       _["opts"] = opts, _["H"] = H, _["X"] = X, _["Zt"] = Zt,
-                       _["St"] = St, _["mu"] = mu, _["nested"] = nested,
-                         _["REML"] = REML, _["verbose"] = verbose,
-                         _["family"] = family, _["totalSize"] = totalSize);
-      opt = List::create(_["par"] = S0["solution"], _["value"] = S0["objective"], 
-                         _["counts"] = S0["iterations"], _["convergence"] = S0["status"], 
-                         _["message"] = S0["message"]);
-    }
       
-    arma::vec par_opt0 = abs(as<arma::vec>(opt["par"]));
-    ss0 = wrap(par_opt0);
-    LL = as_scalar(as<double>(opt["value"]));
-    convcode = as<int>(opt["convergence"]);
-    niter = as<arma::vec>(opt["counts"]);
-    
-    est_ss = par_opt0;
-    est_B = B;
-    ++iteration;
-    if(verbose) Rcout << "var part: " << iteration << " " << LL << std::endl;
-    // Rcout << "var part: " << iteration << " " << LL << " " << ss0 << std::endl;
-    // } // end opt
-  } // end while
+      arma::vec par_opt0 = abs(opt.par);
+      ss0 = par_opt0;
+      out.LL = opt.value;
+      out.convcode = opt.convcode;
+      out.niter = opt.counts;
+      
+      est_ss = par_opt0;
+      est_B = B;
+      ++iteration;
+      if(print) Rcout << "var part: " << iteration << " " << out.LL << std::endl;
+    } // end while
+  } catch (std::exception& e) {
+    out.error = e.what();
+  }
+  
+  out.B = B;
+  out.ss = ss0;
+  out.mu = mu;
+  out.H = H;
+  
+  return out;
+}
+
+// [[Rcpp::export]]
+List pglmm_internal_cpp(const arma::mat& X, const arma::vec& Y,
+                               const arma::sp_mat& Zt, const arma::sp_mat& St,
+                               const List& nested, const bool REML, const bool verbose,
+                               const int n, const int p, const int q, const int maxit, 
+                               const double reltol, const double tol_pql, const double maxit_pql,
+                               const std::string optimizer, arma::mat B_init, arma::vec ss,
+                               const std::string family, arma::vec totalSize,
+                               const int n_threads){
+  Rcpp::checkUserInterrupt();
+  
+  if(optimizer == "Nelder-Mead" && q <= 1){
+    Rcpp::stop("With only 1 random term and cpp = TRUE, phyr cannot run the optimization yet. \n \
+                 Set optimizer to other options, e.g. nelder-mead-nlopt and re-run it. \n \
+                 Or you can turn cpp off with cpp = FALSE and re-run it.");
+  }
+  
+  // Convert once; `mu` and `H` are updated in place
+  PglmmData data(X, Y, Zt, St, nested, REML, family, totalSize);
+  
+  PglmmPQL pql = pglmm_pql_core(data, B_init, ss, optimizer, maxit, reltol,
+                                tol_pql, maxit_pql, verbose, true, n_threads);
+  if (!pql.error.empty()) Rcpp::stop(pql.error);
   
+  // iV isn't returned; it's available in factored form from a model handle
   List out = List::create(
-    _["B"] = B, _["ss"] = ss0, 
-    _["iV"] = iV, _["mu"] = mu, _["H"] = H,
-      _["convcode"] = convcode,
-      _["niter"] = niter,
-      _["LL"] = LL
+    _["B"] = pql.B, _["ss"] = pql.ss, 
+    _["mu"] = pql.mu, _["H"] = pql.H,
+      _["convcode"] = pql.convcode,
+      _["niter"] = pql.niter,
+      _["LL"] = pql.LL
   );
   
   return out;
@@ -0,0 +1,305 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <RcppArmadillo.h>
+#include <random>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <limits>
+#include <memory>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "pglmm.h"
+
+using namespace Rcpp;
+using namespace arma;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Parametric bootstrap for pglmm
+
+ Data are simulated from a fitted model, and then B and the variance components
+ are re-estimated using the same functions as `pglmm_gaussian_internal_cpp` and
+ `pglmm_internal_cpp`, without going back through R.
+ The covariance of the random effects is factorized once for all replicates.
+ Each replicate uses its own random-number generator, seeded from R's RNG and the
+ replicate number, so results don't depend on the number of threads.
+ The same simulator is used by `simulate` (`pglmm_simulate_cpp`).
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+
+/*
+ Simulates responses from a fitted pglmm.
+ For Gaussian models, Y = X B + e with e ~ N(0, s2resid * V); otherwise, the
+ linear predictor X B + b with b ~ N(0, C) is used for binomial or poisson draws.
+ V = I + C, so both use the same factor of C, the covariance of the random
+ effects without the residual (or the weights).
+ C can be singular, so it's factored using its eigendecomposition.
+ Draws can instead be conditional on the fitted random effects, given the fitted
+ linear predictor X B + b, in which case C isn't needed.
+ */
+class PglmmSimulator {
+public:
+  PglmmSimulator(const arma::vec& par, const arma::vec& B, const double& s2resid,
+                 const PglmmData& data)
+    : family(data.family), totalSize(data.totalSize), sd_resid(std::sqrt(s2resid)),
+      eta(data.X * B), C_sqrt() {
+    int n = data.X.n_rows;
+    int q_nonNested = data.q_nonNested();
+    arma::mat C(n, n, fill::zeros);
+    if (q_nonNested > 0) {
+      arma::vec d = vectorise(trans(par.head(q_nonNested)) * data.St);
+      arma::mat Ut(data.Zt);
+      Ut.each_col() %= d;
+      C += trans(Ut) * Ut;
+    }
+    for (int j = 0; j < data.q_Nested(); j++) {
+      C += (par(q_nonNested + j) * par(q_nonNested + j)) * data.nested_dense(j);
+    }
+    arma::vec lambda;
+    arma::mat Q;
+    arma::eig_sym(lambda, Q, C);
+    C_sqrt = Q.each_row() % trans(sqrt(clamp(lambda, 0, datum::inf)));
+  }
+  // Conditional on the fitted random effects, with linear predictor `eta_`
+  PglmmSimulator(const arma::vec& eta_, const double& s2resid, const PglmmData& data)
+    : family(data.family), totalSize(data.totalSize), sd_resid(std::sqrt(s2resid)),
+      eta(eta_), C_sqrt() {}
+
+  arma::vec simulate(std::mt19937_64& eng) const {
+    return simulate(eng, 1).col(0);
+  }
+
+  // `nsim` draws at once (one per column), so the random effects are a single
+  // matrix product
+  arma::mat simulate(std::mt19937_64& eng, const int& nsim) const {
+    int n = eta.n_elem;
+    std::normal_distribution<double> norm(0.0, 1.0);
+    arma::mat eta_i(n, nsim, fill::zeros);
+    if (C_sqrt.n_elem > 0) {
+      arma::mat z(n, nsim);
+      for (uword k = 0; k < z.n_elem; k++) z(k) = norm(eng);
+      eta_i = C_sqrt * z;
+    }
+    arma::mat y(n, nsim);
+    if (family == "gaussian") {
+      for (uword k = 0; k < eta_i.n_elem; k++) eta_i(k) += norm(eng);
+      y = sd_resid * eta_i;
+      y.each_col() += eta;
+    } else if (family == "binomial") {
+      eta_i.each_col() += eta;
+      for (int r = 0; r < nsim; r++) {
+        for (int i = 0; i < n; i++) {
+          int size_i = static_cast<int>(std::round(totalSize(i)));
+          std::binomial_distribution<int> binom(size_i, 1 / (1 + std::exp(-eta_i(i, r))));
+          y(i, r) = binom(eng);
+        }
+      }
+    } else {
+      eta_i.each_col() += eta;
+      for (int r = 0; r < nsim; r++) {
+        for (int i = 0; i < n; i++) {
+          double mu_i = std::max(std::exp(eta_i(i, r)), std::numeric_limits<double>::min());
+          std::poisson_distribution<int> pois(mu_i);
+          y(i, r) = pois(eng);
+        }
+      }
+    }
+    return y;
+  }
+
+private:
+  std::string family;
+  arma::vec totalSize;
+  double sd_resid;
+  arma::vec eta;
+  arma::mat C_sqrt;
+};
+
+
+
+
+//' Inner function for the parametric bootstrap of a pglmm.
+//'
+//' @param B Fitted fixed effects.
+//' @param ss Fitted standard deviations of the random effects (followed by the
+//'   residual standard deviation for gaussian models).
+//' @inheritParams pglmm_bootstrap
+//'
+//' @return a list with a matrix of replicate estimates of B and `ss` (one row
+//'   per replicate), convergence codes, and error messages.
+//' @noRd
+//' @name pglmm_bootstrap_cpp
+//'
+//[[Rcpp::export]]
+List pglmm_bootstrap_cpp(const arma::mat& X, const arma::vec& Y,
+                         const arma::sp_mat& Zt, const arma::sp_mat& St,
+                         const List& nested, const bool REML,
+                         const std::string family, arma::vec totalSize,
+                         const arma::vec& B, const arma::vec& ss,
+                         const std::string optimizer, const int maxit,
+                         const double reltol, const double tol_pql,
+                         const double maxit_pql, const int nboot,
+                         const int n_threads) {
+
+  PglmmData data(X, Y, Zt, St, nested, REML, family, totalSize);
+  int p = X.n_cols;
+  int q = data.q_nonNested() + data.q_Nested();
+  bool gaussian = family == "gaussian";
+  if (static_cast<int>(ss.n_elem) != q + (gaussian ? 1 : 0)) {
+    stop("\nINTERNAL ERROR: wrong number of variance components in pglmm_bootstrap_cpp");
+  }
+  arma::vec par = ss.head(q);
+  double s2resid = gaussian ? ss(q) * ss(q) : 0;
+
+  const PglmmSimulator sim(par, B, s2resid, data);
+  if (gaussian) data.set_gram(arma::vec(X.n_rows, fill::ones), Y);
+
+  // R's L-BFGS-B (Nelder-Mead with one random effect) isn't thread-safe
+  bool use_lbfgsb = gaussian && optimizer == "Nelder-Mead" && q <= 1;
+  int n_thr = use_lbfgsb ? 1 : std::max(n_threads, 1);
+  // nlopt functions are looked up with the R API, so it's done here
+  if (n_thr > 1) pglmm_nlopt_prime();
+
+  // Seed from R's RNG, so results follow `set.seed`
+  uint32_t seed = static_cast<uint32_t>(R::unif_rand() *
+    std::numeric_limits<uint32_t>::max());
+
+  arma::mat boot(nboot, p + ss.n_elem);
+  boot.fill(datum::nan);
+  std::vector<int> convcodes(nboot, -1);
+  std::vector<std::string> errors(nboot);
+
+  // Copies are made here because copying sparse matrices isn't thread-safe
+  std::vector<PglmmData> thread_data(n_thr, data);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_thr)
+#endif
+  for (int r = 0; r < nboot; r++) {
+#ifdef _OPENMP
+    PglmmData& d(thread_data[omp_get_thread_num()]);
+#else
+    PglmmData& d(thread_data[0]);
+#endif
+    try {
+      std::seed_seq seq{seed, static_cast<uint32_t>(r)};
+      std::mt19937_64 eng(seq);
+      arma::vec y = sim.simulate(eng);
+      if (gaussian) {
+        d.set_response(y);
+        pglmm_objective fn = [&d](const arma::vec& par_) {
+          return pglmm_gaussian_LL_core(par_, d);
+        };
+        PglmmOptim opt = pglmm_gaussian_optimize(fn, par, d, optimizer, maxit, reltol,
+                                                 use_lbfgsb);
+        if (!opt.error.empty()) {
+          errors[r] = opt.error;
+          continue;
+        }
+        arma::vec par_r = abs(opt.par);
+        arma::vec B_r;
+        arma::mat B_cov;
+        double s2resid_r;
+        pglmm_gaussian_gls(par_r, d, B_r, B_cov, s2resid_r);
+        boot.row(r) = join_vert(B_r, par_r, arma::vec{std::sqrt(s2resid_r)}).t();
+        convcodes[r] = opt.convcode;
+      } else {
+        d.Y = y;
+        PglmmPQL pql = pglmm_pql_core(d, B, par, optimizer, maxit, reltol,
+                                      tol_pql, maxit_pql, false, false);
+        if (!pql.error.empty()) {
+          errors[r] = pql.error;
+          continue;
+        }
+        boot.row(r) = join_vert(vectorise(pql.B), pql.ss).t();
+        convcodes[r] = pql.convcode;
+      }
+    } catch (std::exception& e) {
+      errors[r] = e.what();
+    }
+  }
+
+  return List::create(_["boot"] = boot, _["convcode"] = convcodes,
+                      _["error"] = errors);
+}
+
+
+
+//' Simulate responses from a fitted pglmm.
+//'
+//' Draws are made in blocks of columns, each with its own random-number generator
+//' seeded from R's RNG and the block number, so results follow `set.seed` regardless
+//' of the number of threads.
+//'
+//' @param B Fitted fixed effects.
+//' @param ss Fitted standard deviations of the random effects (followed by the
+//'   residual standard deviation for gaussian models).
+//' @param eta Fitted linear predictor (X B + b) to simulate conditional on the
+//'   fitted random effects, or an empty vector to simulate new random effects.
+//' @param nsim Number of simulations.
+//' @param n_threads Number of threads.
+//'
+//' @return an n x nsim matrix.
+//' @noRd
+//' @name pglmm_simulate_cpp
+//'
+//[[Rcpp::export]]
+arma::mat pglmm_simulate_cpp(const arma::mat& X,
+                             const arma::sp_mat& Zt, const arma::sp_mat& St,
+                             const List& nested, const std::string family,
+                             arma::vec totalSize, const arma::vec& B,
+                             const arma::vec& ss, const arma::vec& eta,
+                             const int nsim, const int n_threads) {
+
+  PglmmData data(X, arma::vec(), Zt, St, nested, false, family, totalSize);
+  int q = data.q_nonNested() + data.q_Nested();
+  bool gaussian = family == "gaussian";
+  if (static_cast<int>(ss.n_elem) != q + (gaussian ? 1 : 0)) {
+    stop("\nINTERNAL ERROR: wrong number of variance components in pglmm_simulate_cpp");
+  }
+  double s2resid = gaussian ? ss(q) * ss(q) : 0;
+
+  // Factored once (if needed) for all draws
+  std::unique_ptr<const PglmmSimulator> sim;
+  if (eta.n_elem > 0) {
+    sim.reset(new PglmmSimulator(eta, s2resid, data));
+  } else {
+    sim.reset(new PglmmSimulator(arma::vec(ss.head(q)), B, s2resid, data));
+  }
+
+  uint32_t seed = static_cast<uint32_t>(R::unif_rand() *
+    std::numeric_limits<uint32_t>::max());
+
+  const int block_size = 64;
+  int n_blocks = (nsim + block_size - 1) / block_size;
+  arma::mat out(X.n_rows, nsim);
+  int n_thr = std::max(n_threads, 1);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_thr)
+#endif
+  for (int k = 0; k < n_blocks; k++) {
+    std::seed_seq seq{seed, static_cast<uint32_t>(k)};
+    std::mt19937_64 eng(seq);
+    int first = k * block_size;
+    int n_k = std::min(block_size, nsim - first);
+    out.cols(first, first + n_k - 1) = sim->simulate(eng, n_k);
+  }
+
+  return out;
+}
@@ -0,0 +1,244 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <RcppArmadillo.h>
+#include <vector>
+
+using namespace Rcpp;
+using namespace arma;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Building pglmm design matrices
+
+ The random terms' matrices are built directly in sparse form from each
+ observation's group indices, so that dense kronecker products (of size
+ n_site * n_sp squared) and dense indicator matrices are never formed.
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+
+// Sparse matrix from triplets (with 0-based rows and columns)
+static arma::sp_mat triplets_to_sp_mat(const std::vector<uword>& rows,
+                                       const std::vector<uword>& cols,
+                                       const std::vector<double>& vals,
+                                       const uword& n_rows, const uword& n_cols) {
+  arma::umat locations(2, rows.size());
+  for (uword i = 0; i < rows.size(); i++) {
+    locations(0, i) = rows[i];
+    locations(1, i) = cols[i];
+  }
+  return arma::sp_mat(locations, arma::vec(vals), n_rows, n_cols);
+}
+
+
+//' Covariance matrix of a nested random term.
+//'
+//' Element `(a, b)` is `x[a] * x[b] * cov1[g1[a], g1[b]] * cov2[g2[a], g2[b]]`,
+//' where an empty covariance matrix is an identity matrix.
+//' This is `kronecker(cov2, cov1)` restricted to the observed combinations of
+//' `g1` and `g2` (e.g., species and sites).
+//' If either matrix is an identity matrix, only pairs of observations in the same
+//' group are visited.
+//'
+//' @param g1 1-based indices of each observation into `cov1`.
+//' @param g2 1-based indices of each observation into `cov2`.
+//' @param cov1 Covariance matrix for `g1`, or a 0 x 0 matrix for an identity matrix.
+//' @param cov2 Covariance matrix for `g2`, or a 0 x 0 matrix for an identity matrix.
+//' @param x Weights for each observation (for slopes), or an empty vector for ones.
+//'
+//' @return A sparse n x n matrix.
+//' @noRd
+//' @name pglmm_nested_cpp
+//'
+//[[Rcpp::export]]
+arma::sp_mat pglmm_nested_cpp(const IntegerVector& g1, const IntegerVector& g2,
+                              const arma::mat& cov1, const arma::mat& cov2,
+                              const arma::vec& x) {
+
+  int n = g1.size();
+  if (g2.size() != n || (x.n_elem > 0 && static_cast<int>(x.n_elem) != n)) {
+    stop("\nINTERNAL ERROR: wrong lengths in pglmm_nested_cpp.");
+  }
+  if (is_true(any(is_na(g1))) || is_true(any(is_na(g2)))) {
+    stop("\nGroup variables of random terms cannot have missing values.");
+  }
+  bool id1 = cov1.n_elem == 0;
+  bool id2 = cov2.n_elem == 0;
+
+  auto value = [&](const int& a, const int& b) {
+    double v = 1;
+    if (id1) {
+      if (g1[a] != g1[b]) return 0.0;
+    } else {
+      v *= cov1(g1[a] - 1, g1[b] - 1);
+    }
+    if (id2) {
+      if (g2[a] != g2[b]) return 0.0;
+    } else {
+      v *= cov2(g2[a] - 1, g2[b] - 1);
+    }
+    if (x.n_elem > 0) v *= x(a) * x(b);
+    return v;
+  };
+
+  // Observations in each group of an identity factor (or all in one group)
+  std::vector<std::vector<int>> groups;
+  if (id1 || id2) {
+    const IntegerVector& g(id2 ? g2 : g1);
+    int n_groups = n > 0 ? max(g) : 0;
+    groups.resize(n_groups);
+    for (int a = 0; a < n; a++) groups[g[a] - 1].push_back(a);
+  } else {
+    groups.resize(1);
+    for (int a = 0; a < n; a++) groups[0].push_back(a);
+  }
+
+  std::vector<uword> rows, cols;
+  std::vector<double> vals;
+  for (const std::vector<int>& obs : groups) {
+    for (int a : obs) {
+      for (int b : obs) {
+        double v = value(a, b);
+        if (v == 0) continue;
+        rows.push_back(a);
+        cols.push_back(b);
+        vals.push_back(v);
+      }
+    }
+  }
+
+  return triplets_to_sp_mat(rows, cols, vals, n, n);
+}
+
+
+//' Transposed design matrix of a non-nested random term.
+//'
+//' Column `a` is `x[a] * R[, g[a]]`, which is the same as
+//' `R %*% t(Z)`, where `Z` is the n x nlevels indicator matrix of `g` (times `x`),
+//' and `R` is the Cholesky factor of the term's covariance matrix.
+//'
+//' @param g 1-based level of each observation.
+//' @param R Upper-triangular Cholesky factor of the covariance matrix.
+//' @param x Values of the covariate for each observation (ones for intercepts).
+//'
+//' @return A sparse nlevels x n matrix.
+//' @noRd
+//' @name pglmm_Zt_cpp
+//'
+//[[Rcpp::export]]
+arma::sp_mat pglmm_Zt_cpp(const IntegerVector& g, const arma::mat& R,
+                          const arma::vec& x) {
+
+  int n = g.size();
+  if (static_cast<int>(x.n_elem) != n) {
+    stop("\nINTERNAL ERROR: wrong lengths in pglmm_Zt_cpp.");
+  }
+  if (is_true(any(is_na(g)))) {
+    stop("\nGroup variables of random terms cannot have missing values.");
+  }
+  std::vector<uword> rows, cols;
+  std::vector<double> vals;
+  for (int a = 0; a < n; a++) {
+    if (x(a) == 0) continue;
+    uword k = g[a] - 1;
+    for (uword i = 0; i < R.n_rows; i++) {
+      double v = R(i, k);
+      if (v == 0) continue;
+      rows.push_back(i);
+      cols.push_back(a);
+      vals.push_back(x(a) * v);
+    }
+  }
+
+  return triplets_to_sp_mat(rows, cols, vals, R.n_rows, n);
+}
+
+
+//' Cross-covariance of a random term between new and fitted observations, times a vector.
+//'
+//' Element `a` is the sum over fitted observations `b` of
+//' `x_new[a] * x_obs[b] * cov1[g1_new[a], g1_obs[b]] * cov2[g2_new[a], g2_obs[b]] * w[b]`,
+//' where an empty covariance matrix is an identity matrix.
+//' For identity matrices, new observations with `NA` indices are levels that weren't
+//' fitted, so they aren't correlated with any fitted observation; only pairs of
+//' observations in the same group are visited.
+//' This is O(m * n) for m new observations and n fitted ones, or less with an
+//' identity matrix.
+//'
+//' @param g1_new 1-based indices of each new observation into `cov1`.
+//' @param g2_new 1-based indices of each new observation into `cov2`.
+//' @param g1_obs 1-based indices of each fitted observation into `cov1`.
+//' @param g2_obs 1-based indices of each fitted observation into `cov2`.
+//' @param cov1 Covariance matrix for `g1`, or a 0 x 0 matrix for an identity matrix.
+//' @param cov2 Covariance matrix for `g2`, or a 0 x 0 matrix for an identity matrix.
+//' @param x_new Covariate for each new observation (for slopes), or an empty vector for ones.
+//' @param x_obs Covariate for each fitted observation, or an empty vector for ones.
+//' @param w Vector of length n.
+//'
+//' @return A vector of length m.
+//' @noRd
+//' @name pglmm_cross_cov_times
+//'
+//[[Rcpp::export]]
+arma::vec pglmm_cross_cov_times(const IntegerVector& g1_new, const IntegerVector& g2_new,
+                                const IntegerVector& g1_obs, const IntegerVector& g2_obs,
+                                const arma::mat& cov1, const arma::mat& cov2,
+                                const arma::vec& x_new, const arma::vec& x_obs,
+                                const arma::vec& w) {
+
+  int m = g1_new.size();
+  int n = g1_obs.size();
+  if (g2_new.size() != m || g2_obs.size() != n || static_cast<int>(w.n_elem) != n ||
+      (x_new.n_elem > 0 && static_cast<int>(x_new.n_elem) != m) ||
+      (x_obs.n_elem > 0 && static_cast<int>(x_obs.n_elem) != n)) {
+    stop("\nINTERNAL ERROR: wrong lengths in pglmm_cross_cov_times.");
+  }
+  bool id1 = cov1.n_elem == 0;
+  bool id2 = cov2.n_elem == 0;
+
+  auto value = [&](const int& a, const int& b) {
+    double v = w(b);
+    if (id1) {
+      if (g1_new[a] == NA_INTEGER || g1_new[a] != g1_obs[b]) return 0.0;
+    } else {
+      v *= cov1(g1_new[a] - 1, g1_obs[b] - 1);
+    }
+    if (id2) {
+      if (g2_new[a] == NA_INTEGER || g2_new[a] != g2_obs[b]) return 0.0;
+    } else {
+      v *= cov2(g2_new[a] - 1, g2_obs[b] - 1);
+    }
+    if (x_new.n_elem > 0) v *= x_new(a);
+    if (x_obs.n_elem > 0) v *= x_obs(b);
+    return v;
+  };
+
+  arma::vec out(m, fill::zeros);
+  if (id1 || id2) {
+    // Fitted observations in each group of an identity factor
+    const IntegerVector& g_new(id2 ? g2_new : g1_new);
+    const IntegerVector& g_obs(id2 ? g2_obs : g1_obs);
+    int n_groups = n > 0 ? max(g_obs) : 0;
+    std::vector<std::vector<int>> groups(n_groups);
+    for (int b = 0; b < n; b++) groups[g_obs[b] - 1].push_back(b);
+    for (int a = 0; a < m; a++) {
+      if (g_new[a] == NA_INTEGER || g_new[a] > n_groups) continue;
+      for (int b : groups[g_new[a] - 1]) out(a) += value(a, b);
+    }
+  } else {
+    for (int a = 0; a < m; a++) {
+      for (int b = 0; b < n; b++) out(a) += value(a, b);
+    }
+  }
+
+  return out;
+}
@@ -8,136 +8,115 @@
 //
 // [[Rcpp::depends(RcppArmadillo)]]
 
+#include "pglmm.h"
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 using namespace Rcpp;
 using namespace arma;
 
+/*
+ Leave-one-out predictions of H for a Gaussian pglmm.
+ The conditional mean of H_i given all other values, V[i,-i] V[-i,-i]^-1 H[-i],
+ equals H_i - (iV H)_i / iV_ii, so no submatrix of V needs to be inverted and
+ this is O(n^2) rather than O(n^4).
+ */
 // [[Rcpp::export]]
 arma::vec pglmm_gaussian_predict(const arma::mat& iV,
                                  const arma::mat& H){
-  int n = iV.n_rows;
-  arma::mat V = inv(iV);
-  arma::vec h(n);
-  for (int i = 0; i < n; i++) {
-    // V[i, -i]; V[-i, -i]; H[-i]
-    IntegerVector i_idx = seq_len(n) - 1;
-    IntegerVector i_idx_rm = i_idx[i_idx != i];
-    arma::uvec i_keep(1); i_keep(0) = i;
-    arma::uvec i_idx_rm_2 = as<arma::uvec>(i_idx_rm);
-    arma::mat V1 = V.submat(i_keep, i_idx_rm_2);
-    arma::mat V2 = V.submat(i_idx_rm_2, i_idx_rm_2);
-    arma::mat H1 = H.rows(i_idx_rm_2);
-    h(i) = as_scalar(V1 * inv(V2) * H1);
-  }
+  arma::vec iVH = iV * H.col(0);
+  arma::vec h = H.col(0) - iVH / iV.diag();
   return(h);
 }
 
-// [[Rcpp::export]]
-double pglmm_gaussian_LL_cpp(NumericVector par, 
-                           const arma::mat& X, const arma::vec& Y, 
-                           const arma::sp_mat& Zt, const arma::sp_mat& St, 
-                           const List& nested, 
-                           bool REML, bool verbose){
+/*
+ Gaussian pglmm log likelihood function from preconverted data.
+ This doesn't use the R API, so it's safe to call from multiple threads.
+ */
+double pglmm_gaussian_LL_core(const arma::vec& par, const PglmmData& data) {
+  const arma::mat& X(data.X);
+  const arma::vec& Y(data.Y);
   int n = X.n_rows;
   int p = X.n_cols;
-  int q_nonNested = St.n_rows;
-  arma::sp_mat Ut;
-  arma::sp_mat U;
-  if(q_nonNested > 0){
-    IntegerVector idx = seq_len(q_nonNested) - 1; // c++ starts with 0
-    // uvec idx_uvec = as<uvec>(idx);
-    NumericVector sr0 = par[idx];
-    rowvec sr = real(as<rowvec>(sr0));
-    arma::mat iC0 = sr * St;
-    arma::vec iC1 = vectorise(iC0, 0); // extract by columns
-    arma::sp_mat iC = sp_mat(diagmat(iC1));
-    Ut = iC * Zt;
-    U = trans(Ut);
-  }
-  int q_Nested = nested.size();
-
-  NumericVector sn; // pre-declare out of if{}
-  if (q_Nested > 0) {
-    IntegerVector idx2 = wrap(seq(q_nonNested, q_nonNested + q_Nested - 1));
-    NumericVector sn0 = par[idx2];
-    rowvec sn1 = real(as<rowvec>(sn0));
-    sn = as<NumericVector>(wrap(sn1)); // no need to declare type again
-  } 
-  
-  arma::sp_mat iV0;
-  arma::mat Ishort_Ut_iA_U;
-  if (q_Nested == 0){ // then q_nonNested will not be 0, otherwise, no random terms
-    arma::sp_mat iA = sp_mat(n, n); iA.eye();
-    arma::sp_mat Ishort = sp_mat(Ut.n_rows, Ut.n_rows); Ishort.eye();
-    arma::sp_mat Ut_iA_U = Ut * U;
-    // Woodbury identity
-    Ishort_Ut_iA_U = mat(Ishort + Ut_iA_U);
-    arma::mat i_Ishort_Ut_iA_U = inv(Ishort_Ut_iA_U);
-    iV0 = iA - U * sp_mat(i_Ishort_Ut_iA_U) * Ut;
-  } else {
-    arma::sp_mat A = sp_mat(n, n); A.eye();
-    if (q_Nested == 1){
-      double snj = pow(sn[0], 2);
-      sp_mat nj = nested[0];
-      A = A + snj * nj;
-    } else {
-      for (int j = 0; j < q_Nested; j++) {
-        double snj = pow(sn[j], 2);
-        sp_mat nj = nested[j];
-        A = A + snj * nj;
-      }
-    }
-    arma::mat A1(A);
-    arma::sp_mat iA = sp_mat(inv(A1));
-    // Rcout << iA << " " ;
-    if(q_nonNested > 0){
-      arma::sp_mat Ishort = sp_mat(Ut.n_rows, Ut.n_rows); Ishort.eye();
-      arma::sp_mat Ut_iA_U = Ut * iA * U;
-      Ishort_Ut_iA_U = mat(Ishort + Ut_iA_U);
-      arma::mat i_Ishort_Ut_iA_U = inv(Ishort_Ut_iA_U);
-      iV0 = iA - iA * U * sp_mat(i_Ishort_Ut_iA_U) * Ut * iA;
-    } else {
-      iV0 = iA;
-    }
-  }
-  
-  arma::mat iV(iV0); // convert to dense matrix
-  arma::mat denom = trans(X) * iV * X;
-  arma::mat num = trans(X) * iV * Y;
-  arma::mat B = solve(denom, num);
-  arma::vec H = Y - X * B;
   
+  // Both without the residual variance, which is profiled out:
+  arma::mat denom;
   double logdetV;
-  double signV;
-  if (q_Nested == 0) {
-    // Sylvester identity
-    log_det(logdetV, signV, Ishort_Ut_iA_U); 
-    NumericVector logdetV1 = NumericVector::create(logdetV);
-    if(any(is_infinite(logdetV1))){
-      arma::mat lgm = chol(Ishort_Ut_iA_U);
-      logdetV = 2 * sum(log(lgm.diag()));
-    }
+  double HiVH;
+  if (data.gram.ok) {
+    // Only reweight the precomputed Gram blocks
+    arma::vec num;
+    double YiVY;
+    pglmm_gram_forms(par, data, denom, num, YiVY, logdetV);
+    arma::vec B = solve(denom, num);
+    // H' iV H, where H = Y - X * B:
+    HiVH = YiVY - dot(num, B);
+  } else if (data.iterative.ok) {
+    // Matrix-free, with iV [X, Y] by PCG and log|V| by SLQ
+    arma::mat iV_XY = pglmm_iterative_solve(par, data, join_rows(X, Y));
+    logdetV = pglmm_iterative_logdet(par, data);
+    arma::mat iV_X = iV_XY.head_cols(p);
+    denom = trans(X) * iV_X;
+    arma::vec num = trans(iV_X) * Y;
+    arma::vec B = solve(denom, num);
+    HiVH = dot(Y, iV_XY.col(p)) - dot(num, B);
   } else {
-    log_det(logdetV, signV, iV);
-    logdetV = -1 * logdetV;
-    NumericVector logdetV1 = NumericVector::create(logdetV);
-    if(any(is_infinite(logdetV1))){
-      arma::mat lgm = chol(iV);
-      logdetV = -2 * sum(log(lgm.diag()));
-    }
+    // iV in factored form
+    const PglmmVinv Vinv(par, data, arma::vec(n, fill::ones));
+    logdetV = Vinv.logdetV;
+    arma::mat iV_X = Vinv.times(X);
+    denom = trans(X) * iV_X;
+    arma::mat num = trans(iV_X) * Y;
+    arma::mat B = solve(denom, num);
+    arma::vec H = Y - X * B;
+    HiVH = as_scalar(Vinv.quad(H));
   }
   
   double LL;
-  if(REML){
-    double s2_conc = as_scalar(trans(H) * iV * H) / (n - p);
+  if(data.REML){
+    double s2_conc = HiVH / (n - p);
     double logdetL;
     double signL;
     log_det(logdetL, signL, denom);
     LL = 0.5 * ((n - p) * log(s2_conc) + logdetV + (n - p) + logdetL);
   } else {
-    double s2_conc = as_scalar(trans(H) * iV * H) / n;
+    double s2_conc = HiVH / n;
     LL = 0.5 * (n * log(s2_conc) + logdetV + n);
   }
   
+  return LL;
+}
+
+/*
+ GLS estimates at `par` from preconverted data.
+ This doesn't use the R API, so it's safe to call from multiple threads.
+ */
+void pglmm_gaussian_gls(const arma::vec& par, const PglmmData& data,
+                        arma::vec& B, arma::mat& B_cov, double& s2resid) {
+  const arma::mat& X(data.X);
+  int n = X.n_rows;
+  int p = X.n_cols;
+  const PglmmVinv Vinv(par, data, arma::vec(n, fill::ones));
+  arma::mat iV_X = Vinv.times(X);
+  arma::mat denom = trans(X) * iV_X;
+  B = solve(denom, trans(iV_X) * data.Y);
+  arma::vec H = data.Y - X * B;
+  s2resid = as_scalar(Vinv.quad(H)) / (data.REML ? (n - p) : n);
+  B_cov = s2resid * inv(denom);
+  return;
+}
+
+// [[Rcpp::export]]
+double pglmm_gaussian_LL_cpp(NumericVector par, 
+                           const arma::mat& X, const arma::vec& Y, 
+                           const arma::sp_mat& Zt, const arma::sp_mat& St, 
+                           const List& nested, 
+                           bool REML, bool verbose){
+  PglmmData data(X, Y, Zt, St, nested, REML);
+  double LL = pglmm_gaussian_LL_core(as<arma::vec>(par), data);
+  
   if(verbose){
     Rcout << LL << " " << par << std::endl;
   }
@@ -145,113 +124,47 @@ double pglmm_gaussian_LL_cpp(NumericVector par,
   return LL;
 }
 
-// [[Rcpp::export]]
-List pglmm_gaussian_LL_calc_cpp(NumericVector par, 
-                                const arma::mat& X, const arma::vec& Y, 
-                                const arma::sp_mat& Zt, const arma::sp_mat& St, 
-                                const List& nested, bool REML){
+// Output from a Gaussian pglmm at parameters `par` using preconverted data
+List pglmm_gaussian_LL_calc_core(const arma::vec& par, const PglmmData& data){
+  const arma::mat& X(data.X);
+  const arma::vec& Y(data.Y);
   int n = X.n_rows;
   int p = X.n_cols;
-  int q_nonNested = St.n_rows;
-  arma::sp_mat Ut;
-  arma::sp_mat U;
+  int q_nonNested = data.q_nonNested();
+  int q_Nested = data.q_Nested();
   arma::rowvec sr;
-  if(q_nonNested > 0){
-    IntegerVector idx = seq_len(q_nonNested) - 1; // c++ starts with 0
-    // uvec idx_uvec = as<uvec>(idx);
-    NumericVector sr0 = par[idx];
-    sr = real(as<rowvec>(sr0));
-    arma::mat iC0 = sr * St;
-    arma::vec iC1 = vectorise(iC0, 0); // extract by columns
-    arma::sp_mat iC = sp_mat(diagmat(iC1));
-    Ut = iC * Zt;
-    U = trans(Ut);
-  }
-  
-  int q_Nested = nested.size();
-  
-  NumericVector sn; // pre-declare out of if{}
-  if (q_Nested > 0) {
-    IntegerVector idx2 = wrap(seq(q_nonNested, q_nonNested + q_Nested - 1));
-    NumericVector sn0 = par[idx2];
-    rowvec sn1 = real(as<rowvec>(sn0));
-    sn = as<NumericVector>(wrap(sn1)); // no need to declare type again
-  } 
+  if (q_nonNested > 0) sr = trans(par.subvec(0, q_nonNested - 1));
+  arma::vec sn;
+  if (q_Nested > 0) sn = par.subvec(q_nonNested, q_nonNested + q_Nested - 1);
   
-  arma::sp_mat iV0;
-  arma::mat Ishort_Ut_iA_U;
-  if (q_Nested == 0){
-    arma::sp_mat iA = sp_mat(n, n); iA.eye();
-    arma::sp_mat Ishort = sp_mat(Ut.n_rows, Ut.n_rows); Ishort.eye();
-    arma::sp_mat Ut_iA_U = Ut * U;
-    // Woodbury identity
-    Ishort_Ut_iA_U = mat(Ishort + Ut_iA_U);
-    arma::mat i_Ishort_Ut_iA_U = inv(Ishort_Ut_iA_U);
-    iV0 = iA - U * sp_mat(i_Ishort_Ut_iA_U) * Ut;
+  arma::mat iV_X;
+  double HiVH;
+  arma::mat B;
+  arma::vec H;
+  if (data.iterative.ok) {
+    iV_X = pglmm_iterative_solve(par, data, X);
+    B = solve(trans(X) * iV_X, trans(iV_X) * Y);
+    H = Y - X * B;
+    HiVH = dot(H, pglmm_iterative_solve(par, data, H));
   } else {
-    arma::sp_mat A = sp_mat(n, n); A.eye();
-    if (q_Nested == 1){
-      double snj = pow(sn[0], 2);
-      sp_mat nj = nested[0];
-      A = A + snj * nj;
-    } else {
-      for (int j = 0; j < q_Nested; j++) {
-        double snj = pow(sn[j], 2);
-        sp_mat nj = nested[j];
-        A = A + snj * nj;
-      }
-    }
-    arma::mat A1(A);
-    arma::sp_mat iA = sp_mat(inv(A1));
-    // Rcout << iA << " " ;
-    if(q_nonNested > 0){
-      arma::sp_mat Ishort = sp_mat(Ut.n_rows, Ut.n_rows); Ishort.eye();
-      arma::sp_mat Ut_iA_U = Ut * iA * U;
-      Ishort_Ut_iA_U = mat(Ishort + Ut_iA_U);
-      arma::mat i_Ishort_Ut_iA_U = inv(Ishort_Ut_iA_U);
-      iV0 = iA - iA * U * sp_mat(i_Ishort_Ut_iA_U) * Ut * iA;
-    } else {
-      iV0 = iA;
-    }
-  }
-  
-  arma::mat iV(iV0); // convert to dense matrix
-  arma::mat denom = trans(X) * iV * X;
-  arma::mat num = trans(X) * iV * Y;
-  arma::mat B = solve(denom, num);
-  arma::vec H = Y - X * B;
-  
-  double logdetV;
-  double signV;
-  if (q_Nested == 0) {
-    // Sylvester identity
-    log_det(logdetV, signV, Ishort_Ut_iA_U); 
-    NumericVector logdetV1 = NumericVector::create(logdetV);
-    if(any(is_infinite(logdetV1))){
-      arma::mat lgm = chol(Ishort_Ut_iA_U);
-      logdetV = 2 * sum(log(lgm.diag()));
-    }
-  } else {
-    log_det(logdetV, signV, iV);
-    logdetV = -1 * logdetV;
-    NumericVector logdetV1 = NumericVector::create(logdetV);
-    if(any(is_infinite(logdetV1))){
-      arma::mat lgm = chol(iV);
-      logdetV = -2 * sum(log(lgm.diag()));
-    }
+    const PglmmVinv Vinv(par, data, arma::vec(n, fill::ones));
+    iV_X = Vinv.times(X);
+    B = solve(trans(X) * iV_X, trans(iV_X) * Y);
+    H = Y - X * B;
+    HiVH = as_scalar(Vinv.quad(H));
   }
+  arma::mat denom = trans(X) * iV_X;
   
   double s2resid;
-  if(REML){
-    s2resid = as_scalar(trans(H) * iV * H) / (n - p);
+  if(data.REML){
+    s2resid = HiVH / (n - p);
   } else {
-    s2resid = as_scalar(trans(H) * iV * H) / n;
+    s2resid = HiVH / n;
   }
   
-  iV = iV/s2resid;
   rowvec s2r = s2resid * pow(sr, 2);
-  NumericVector s2n = s2resid * pow(sn, 2);
-  arma::mat B_cov = inv(trans(X) * iV * X);
+  arma::vec s2n = s2resid * pow(sn, 2);
+  arma::mat B_cov = inv(denom / s2resid);
   arma::vec B_se = sqrt(B_cov.diag());
   
   return List::create(
@@ -259,78 +172,260 @@ List pglmm_gaussian_LL_calc_cpp(NumericVector par,
     _["B.se"] = B_se,
     _["B.cov"] = B_cov,
     _["sr"] = sr,
-    _["sn"] = sn,
-    _["s2n"] = s2n,
+    _["sn"] = NumericVector(sn.begin(), sn.end()),
+    _["s2n"] = NumericVector(s2n.begin(), s2n.end()),
     _["s2r"] = s2r,
     _["s2resid"] = s2resid,
-    _["iV"] = iV,
     _["H"] = H
   );
 }
 
+// [[Rcpp::export]]
+List pglmm_gaussian_LL_calc_cpp(NumericVector par, 
+                                const arma::mat& X, const arma::vec& Y, 
+                                const arma::sp_mat& Zt, const arma::sp_mat& St, 
+                                const List& nested, bool REML){
+  PglmmData data(X, Y, Zt, St, nested, REML);
+  return pglmm_gaussian_LL_calc_core(as<arma::vec>(par), data);
+}
+
+/*
+ AI-REML for the variance components of a Gaussian pglmm.
+
+ The variances are theta = (s2resid, s2resid * sr^2, s2resid * sn^2), and
+ V* = s2resid * V(par), with derivatives G = I for the residual, Zt_k' Zt_k
+ (rows of Zt for the k-th non-nested term) for non-nested terms, and the
+ matrices in `nested` for nested terms.
+ Each iteration takes the scoring step theta + AI^-1 * score, where
+   score_i = -0.5 * (tr(P* G_i) - y' P* G_i P* y)
+   AI_ij   = 0.5 * y' P* G_i P* G_j P* y,
+ and P* = P / s2resid is the REML projection (iV* for ML).
+ Steps are halved until the variances are non-negative and the likelihood
+ doesn't decrease, and s2resid is re-profiled after every step.
+ `convcode` is 0 on convergence, 1 if `maxit` is reached, 2 if AI is singular, and
+ 3 if no step improves the likelihood away from a stationary point.
+ Only the traces need more than a few products with iV; with nested terms they
+ use selected inversion of A's sparse factor (see `PglmmVinv::trace_nested`),
+ so iV is never formed.
+ */
+PglmmOptim pglmm_gaussian_ai(const pglmm_objective& fn,
+                             const arma::vec& par0,
+                             const PglmmData& data,
+                             const int& maxit,
+                             const double& reltol) {
+  
+  PglmmOptim out;
+  
+  const arma::mat& X(data.X);
+  const arma::vec& Y(data.Y);
+  int n = X.n_rows;
+  int p = X.n_cols;
+  int q_nonNested = data.q_nonNested();
+  int q_Nested = data.q_Nested();
+  int q = q_nonNested + q_Nested;
+  double df = data.REML ? static_cast<double>(n - p) : static_cast<double>(n);
+  
+  // Dense copies, used for the non-nested terms' derivatives
+  arma::mat Z, St;
+  if (q_nonNested > 0) {
+    Z = arma::mat(data.Zt.t());
+    St = arma::mat(data.St);
+  }
+  
+  arma::vec par = abs(par0);
+  double value = fn(par);
+  int iter = 0;
+  out.convcode = 1;
+  
+  try {
+    while (iter < maxit) {
+      
+      iter++;
+      
+      const PglmmVinv Vinv(par, data, arma::vec(n, fill::ones));
+      arma::mat iV_X = Vinv.times(X);
+      arma::mat iS = inv_sympd(trans(X) * iV_X);
+      arma::vec B = iS * (trans(iV_X) * Y);
+      // P y = iV (Y - X B) for both REML and ML
+      arma::vec Py = Vinv.times(Y - X * B);
+      double s2 = dot(Y, Py) / df;
+      
+      // P (or iV for ML) without s2resid
+      auto P_times = [&](const arma::mat& A) {
+        arma::mat PA = Vinv.times(A);
+        if (data.REML) PA -= iV_X * (iS * (trans(iV_X) * A));
+        return PA;
+      };
+      
+      // G_i P y for each variance
+      arma::mat GPy(n, q + 1);
+      GPy.col(0) = Py;
+      arma::vec ZPZ_diag;
+      if (q_nonNested > 0) {
+        arma::vec ZtPy = data.Zt * Py;
+        for (int k = 0; k < q_nonNested; k++) {
+          GPy.col(1 + k) = Z * (ZtPy % trans(St.row(k)));
+        }
+        ZPZ_diag = arma::sum(Z % P_times(Z), 0).t();
+      }
+      for (int j = 0; j < q_Nested; j++) {
+        GPy.col(1 + q_nonNested + j) = data.nested_times(j, Py);
+      }
+      
+      // tr(P G_i)
+      arma::vec tr(q + 1);
+      tr(0) = accu(Vinv.diag());
+      if (data.REML) tr(0) -= trace(iS * (trans(iV_X) * iV_X));
+      for (int k = 0; k < q_nonNested; k++) {
+        tr(1 + k) = dot(St.row(k), ZPZ_diag);
+      }
+      arma::vec tr_nested = Vinv.trace_nested(data);
+      for (int j = 0; j < q_Nested; j++) {
+        double trj = tr_nested(j);
+        if (data.REML) trj -= trace(iS * (trans(iV_X) * data.nested_times(j, iV_X)));
+        tr(1 + q_nonNested + j) = trj;
+      }
+      
+      arma::vec score = -0.5 * (tr / s2 - trans(GPy) * Py / (s2 * s2));
+      arma::mat AI = 0.5 * trans(GPy) * P_times(GPy) / (s2 * s2 * s2);
+      arma::vec step;
+      if (!solve(step, AI, score)) {
+        out.convcode = 2;
+        break;
+      }
+      
+      arma::vec theta(q + 1);
+      theta(0) = s2;
+      theta.subvec(1, q) = s2 * square(par);
+      
+      // Step-halving, with components on the boundary kept at zero
+      bool accepted = false;
+      double a = 1;
+      arma::vec par_new;
+      double value_new = value;
+      for (int h = 0; h < 10; h++, a *= 0.5) {
+        arma::vec theta_new = theta + a * step;
+        if (theta_new(0) <= 0) continue;
+        theta_new.subvec(1, q) = clamp(theta_new.subvec(1, q), 0, datum::inf);
+        par_new = sqrt(theta_new.subvec(1, q) / theta_new(0));
+        value_new = fn(par_new);
+        if (value_new <= value) {
+          accepted = true;
+          break;
+        }
+      }
+      
+      /*
+       No step improves the likelihood. That's only the optimum if the score is
+       negligible, ignoring variances at zero whose score points below zero;
+       its size is the expected improvement from the scoring step, 0.5 score' AI^-1 score.
+       Otherwise (e.g., with an ill-conditioned AI), the fit failed.
+       */
+      if (!accepted) {
+        std::vector<arma::uword> free_;
+        for (int i = 0; i <= q; i++) {
+          if (theta(i) > 0 || score(i) > 0) free_.push_back(i);
+        }
+        arma::uvec free(free_);
+        double gain = 0;
+        if (free.n_elem > 0) {
+          arma::vec step_free;
+          if (solve(step_free, AI.submat(free, free), score.elem(free))) {
+            gain = 0.5 * dot(score.elem(free), step_free);
+          } else {
+            gain = datum::inf;
+          }
+        }
+        out.convcode = (std::abs(gain) <= std::sqrt(reltol) * (std::abs(value) + 1)) ? 0 : 3;
+        break;
+      }
+      
+      double change = value - value_new;
+      par = par_new;
+      value = value_new;
+      if (change <= reltol * (std::abs(value) + reltol)) {
+        out.convcode = 0;
+        break;
+      }
+    }
+  } catch (std::exception& e) {
+    out.error = e.what();
+  }
+  
+  out.par = par;
+  out.value = value;
+  out.counts = {static_cast<double>(iter), NA_REAL};
+  
+  return out;
+}
+
+PglmmOptim pglmm_gaussian_optimize(const pglmm_objective& fn,
+                                   const arma::vec& par0,
+                                   const PglmmData& data,
+                                   const std::string& optimizer,
+                                   const int& maxit,
+                                   const double& reltol,
+                                   const bool& use_lbfgsb) {
+  if (optimizer == "ai-reml") {
+    return pglmm_gaussian_ai(fn, par0, data, maxit, reltol);
+  }
+  return pglmm_optimize(fn, par0, optimizer, maxit, reltol, use_lbfgsb);
+}
+
 // [[Rcpp::export]]
 Rcpp::List pglmm_gaussian_internal_cpp(NumericVector par, 
                                        const arma::mat& X, const arma::vec& Y, 
                                        const arma::sp_mat& Zt, const arma::sp_mat& St, 
                                        const List& nested, bool REML, bool verbose,
                                        std::string optimizer, int maxit, double reltol,
-                                       int q, int n, int p, const double Pi
+                                       int q, int n, int p, const double Pi,
+                                       const List& iterative, int n_threads
                                        ){
   Rcpp::checkUserInterrupt();
-  // start optimization
-  Rcpp::Environment stats("package:stats"); 
-  Rcpp::Function optim = stats["optim"]; 
-  Rcpp::Environment nloptr_pkg = Rcpp::Environment::namespace_env("nloptr");
-  Rcpp::Function nloptr = nloptr_pkg["nloptr"];
-  Rcpp::Environment phyr_pkg = Rcpp::Environment::namespace_env("phyr");
-  Rcpp::Function pglmm_gaussian_LL_cpp_fxn = phyr_pkg["pglmm_gaussian_LL_cpp"];
   
-  Rcpp::List opt;
-  if(optimizer == "Nelder-Mead"){
-    if(q > 1){
-      opt = optim(_["par"]    = par,
-                  _["fn"]     = pglmm_gaussian_LL_cpp_fxn,
-                  _["X"] = X, _["Y"] = Y, _["Zt"] = Zt,
-                  _["St"] = St, _["nested"] = nested,
-                  _["REML"] = REML, _["verbose"] = verbose,
-                  _["method"] = "Nelder-Mead",
-                  _["control"] = List::create(_["maxit"] = maxit, _["reltol"] = reltol));
-    } else {
-      opt = optim(_["par"]    = par,
-                  _["fn"]     = pglmm_gaussian_LL_cpp_fxn,
-                  _["X"] = X, _["Y"] = Y, _["Zt"] = Zt,
-                  _["St"] = St, _["nested"] = nested,
-                  _["REML"] = REML, _["verbose"] = verbose,
-                  _["method"] = "L-BFGS-B",
-                  _["control"] = List::create(_["maxit"] = maxit));
+  // Convert once, then optimize in C++ without going back through R
+  PglmmData data(X, Y, Zt, St, nested, REML);
+  data.set_gram(arma::vec(n, fill::ones), Y);
+  // The matrix-free engine is only needed when the Gram blocks can't be used
+  if (iterative.size() > 0 && !data.gram.ok) {
+    data.set_iterative(as<double>(iterative["tol"]), as<int>(iterative["maxit"]),
+                       as<int>(iterative["probes"]), as<int>(iterative["steps"]),
+                       as<int>(iterative["seed"]));
+  }
+  
+  pglmm_objective fn = [&data, verbose](const arma::vec& par_) {
+    double LL_ = pglmm_gaussian_LL_core(par_, data);
+    if (verbose) pglmm_print_eval(LL_, par_);
+    return LL_;
+  };
+  
+  // With one random effect, "Nelder-Mead" uses L-BFGS-B as `stats::optim` would
+  PglmmOptim opt;
+  if (n_threads > 1 && optimizer == "Nelder-Mead" && q > 1) {
+    // Other threads evaluate candidate points using their own copies, which are
+    // made here because copying sparse matrices isn't thread-safe
+    std::vector<PglmmData> thread_data(n_threads - 1, data);
+    std::vector<pglmm_objective> fns(1, fn);
+    for (const PglmmData& d : thread_data) {
+      fns.push_back([&d](const arma::vec& par_) {
+        return pglmm_gaussian_LL_core(par_, d);
+      });
     }
+    opt = pglmm_optimize_parallel(fns, as<arma::vec>(par), maxit, reltol);
   } else {
-    std::string nlopt_algor;
-    if (optimizer == "bobyqa") nlopt_algor = "NLOPT_LN_BOBYQA";
-    if (optimizer == "nelder-mead-nlopt") nlopt_algor = "NLOPT_LN_NELDERMEAD";
-    if (optimizer == "subplex") nlopt_algor = "NLOPT_LN_SBPLX";
-    List opts = List::create(_["algorithm"] = nlopt_algor,
-                             _["ftol_rel"] = reltol, _["ftol_abs"] = reltol,
-                             _["xtol_rel"] = 0.0001,
-                             _["maxeval"] = maxit);
-    List S0 = nloptr(_["x0"] = par,
-                     _["eval_f"] = pglmm_gaussian_LL_cpp_fxn,
-                     _["opts"] = opts, _["X"] = X, _["Y"] = Y, _["Zt"] = Zt,
-                     _["St"] = St, _["nested"] = nested,
-                     _["REML"] = REML, _["verbose"] = verbose);
-    opt = List::create(_["par"] = S0["solution"], _["value"] = S0["objective"],
-                      _["counts"] = S0["iterations"], _["convergence"] = S0["status"],
-                      _["message"] = S0["message"]);
+    opt = pglmm_gaussian_optimize(fn, as<arma::vec>(par), data, optimizer,
+                                  maxit, reltol, q <= 1);
   }
+  if (!opt.error.empty()) Rcpp::stop(opt.error);
+  
   // end of optimization
-  arma::vec par_opt0 = abs(real(as<arma::vec>(opt["par"])));
-  NumericVector par_opt = wrap(par_opt0);
-  double LL = as_scalar(as<double>(opt["value"]));
-  int convcode = as<int>(opt["convergence"]);
-  arma::vec niter = as<arma::vec>(opt["counts"]);
+  arma::vec par_opt = abs(opt.par);
+  double LL = opt.value;
+  int convcode = opt.convcode;
+  arma::vec niter = opt.counts;
   
   // calculate coef
-  List out = pglmm_gaussian_LL_calc_cpp(par_opt, X, Y, Zt, St, nested, REML);
+  List out = pglmm_gaussian_LL_calc_core(par_opt, data);
   double logLik, detx, signx;
   if(REML){
     log_det(detx, signx, trans(X) * X);
@@ -344,6 +439,118 @@ Rcpp::List pglmm_gaussian_internal_cpp(NumericVector par,
                       _["convcode"] = convcode, _["niter"] = niter);
 }
 
+/*
+ Fit a Gaussian pglmm to every column of `Y`, all sharing one design.
+
+ The data are converted (and the Gram blocks computed) once, and only the
+ response blocks are updated for each column.
+ The first column is fit from `par`, and the rest are split into contiguous
+ chunks, one per thread, with each fit warm-started from the variance components
+ of the previous column.
+ R's L-BFGS-B isn't thread-safe, so it's only used from one thread.
+ */
+// [[Rcpp::export]]
+Rcpp::List pglmm_gaussian_multi_cpp(NumericVector par, 
+                                    const arma::mat& X, const arma::mat& Y, 
+                                    const arma::sp_mat& Zt, const arma::sp_mat& St, 
+                                    const List& nested, bool REML,
+                                    std::string optimizer, int maxit, double reltol,
+                                    int q, int n, int p, const double Pi,
+                                    int n_threads){
+  
+  int k = Y.n_cols;
+  if (k == 0) stop("\nINTERNAL ERROR: no responses in pglmm_gaussian_multi_cpp");
+  
+  PglmmData data(X, Y.col(0), Zt, St, nested, REML);
+  data.set_gram(arma::vec(n, fill::ones), Y.col(0));
+  
+  bool use_lbfgsb = q <= 1;
+  int n_thr = std::max(n_threads, 1);
+  if (optimizer == "Nelder-Mead" && use_lbfgsb) n_thr = 1;
+  // nlopt functions are looked up with the R API, so it's done here
+  if (n_thr > 1) pglmm_nlopt_prime();
+  
+  // Constant to convert from the minimized function to the log likelihood
+  double logLik_const, detx, signx;
+  if(REML){
+    log_det(detx, signx, trans(X) * X);
+    logLik_const = -0.5 * (n - p) * log(2 * Pi) + 0.5 * detx;
+  } else {
+    logLik_const = -0.5 * n * log(2 * Pi);
+  }
+  
+  arma::mat B_out(p, k), B_se_out(p, k), ss_out(q + 1, k);
+  arma::vec s2resid_out(k), logLik_out(k);
+  B_out.fill(datum::nan);
+  B_se_out.fill(datum::nan);
+  ss_out.fill(datum::nan);
+  s2resid_out.fill(datum::nan);
+  logLik_out.fill(datum::nan);
+  std::vector<int> convcodes(k, -1), niters(k, 0);
+  std::vector<std::string> errors(k);
+  
+  /*
+   Fit column `i` using `d`, whose response is replaced.
+   Returns the estimates, or `par0` if there was an error, so they can be used
+   as the starting values for the next column.
+   This doesn't use the R API unless L-BFGS-B is used.
+   */
+  auto fit_one = [&](PglmmData& d, const int& i, const arma::vec& par0) {
+    try {
+      d.set_response(Y.col(i));
+      pglmm_objective fn = [&d](const arma::vec& par_) {
+        return pglmm_gaussian_LL_core(par_, d);
+      };
+      PglmmOptim opt = pglmm_gaussian_optimize(fn, par0, d, optimizer, maxit, reltol,
+                                               use_lbfgsb);
+      if (!opt.error.empty()) {
+        errors[i] = opt.error;
+        return par0;
+      }
+      arma::vec par_opt = abs(opt.par);
+      arma::vec B;
+      arma::mat B_cov;
+      double s2resid;
+      pglmm_gaussian_gls(par_opt, d, B, B_cov, s2resid);
+      
+      B_out.col(i) = B;
+      B_se_out.col(i) = sqrt(B_cov.diag());
+      ss_out.col(i).head(q) = par_opt;
+      ss_out(q, i) = std::sqrt(s2resid);
+      s2resid_out(i) = s2resid;
+      logLik_out(i) = logLik_const - opt.value;
+      convcodes[i] = opt.convcode;
+      niters[i] = static_cast<int>(opt.counts(0));
+      return par_opt;
+    } catch (std::exception& e) {
+      errors[i] = e.what();
+    }
+    return par0;
+  };
+  
+  arma::vec par_first = fit_one(data, 0, as<arma::vec>(par));
+  
+  if (k > 1) {
+    int n_chunks = std::min(n_thr, k - 1);
+    // Copies are made here because copying sparse matrices isn't thread-safe
+    std::vector<PglmmData> chunk_data(n_chunks, data);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) num_threads(n_thr)
+#endif
+    for (int c = 0; c < n_chunks; c++) {
+      int i0 = 1 + (k - 1) * c / n_chunks;
+      int i1 = 1 + (k - 1) * (c + 1) / n_chunks;
+      arma::vec par_i = par_first;
+      for (int i = i0; i < i1; i++) par_i = fit_one(chunk_data[c], i, par_i);
+    }
+  }
+  
+  return List::create(_["B"] = B_out, _["B.se"] = B_se_out, _["ss"] = ss_out,
+                      _["s2resid"] = s2resid_out, _["logLik"] = logLik_out,
+                      _["convcode"] = convcodes, _["niter"] = niters,
+                      _["error"] = errors);
+}
+
 /*** R
 # pglmm_gaussian_predict(x$iV, x$H)
 # pglmm_gaussian_internal_cpp(par = s, X, Y, Zt = as(matrix(0, 0, 0), "dgTMatrix"), 
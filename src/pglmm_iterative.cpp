@@ -0,0 +1,214 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <RcppArmadillo.h>
+#include <random>
+#include <cstdint>
+#include <vector>
+#include <cmath>
+#include <limits>
+
+#include "pglmm.h"
+
+using namespace Rcpp;
+using namespace arma;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Matrix-free likelihood for Gaussian pglmm
+
+ For very large numbers of observations, even sparse factorizations of V are too
+ costly, so V is only used through products with Zt, St, and the nested terms:
+   V B = B + Zt' diag(d^2) Zt B + sum_j sn_j^2 N_j B, with d = sr * St.
+ iV B comes from preconditioned conjugate gradients (PCG) with all columns of B
+ solved together, and log|V| = log|D| + log|D^-1/2 V D^-1/2| (with D = diag(V))
+ from stochastic Lanczos quadrature (SLQ):
+   log|A| ~ n / n_probes * sum_l e1' log(T_l) e1,
+ where T_l is the tridiagonal matrix from `steps` Lanczos steps on A starting from
+ the l-th Rademacher probe.
+ Accuracy is set by the PCG tolerance and the number of probes and steps.
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+
+// Rademacher probe vectors (n x k), always the same for the same `seed`
+static arma::mat pglmm_iterative_probes(const int& n, const int& k, const int& seed) {
+  std::mt19937_64 eng(static_cast<uint64_t>(seed));
+  std::bernoulli_distribution coin(0.5);
+  arma::mat Z(n, k);
+  for (uword i = 0; i < Z.n_elem; i++) Z(i) = coin(eng) ? 1.0 : -1.0;
+  return Z;
+}
+
+
+void PglmmData::set_iterative(const double& tol, const int& maxit, const int& n_probes,
+                              const int& steps, const int& seed) {
+  iterative = PglmmIterative();
+  iterative.tol = tol;
+  iterative.maxit = maxit;
+  iterative.n_probes = n_probes;
+  iterative.steps = steps;
+  iterative.seed = seed;
+  if (q_nonNested() > 0) {
+    iterative.Z = Zt.t();
+    iterative.Z2 = iterative.Z % iterative.Z;
+  }
+  int n = X.n_rows;
+  iterative.nested_diag.resize(q_Nested());
+  for (int j = 0; j < q_Nested(); j++) {
+    arma::vec& diag_j(iterative.nested_diag[j]);
+    if (is_augmented(j)) {
+      // Only products are available, so this is estimated from the probes
+      // (it's only used for preconditioning)
+      arma::mat Z = pglmm_iterative_probes(n, n_probes, seed);
+      diag_j = clamp(arma::mean(Z % nested_times(j, Z), 1), 0, datum::inf);
+    } else {
+      const arma::sp_mat& N(nested[j]);
+      diag_j.set_size(n);
+      for (int i = 0; i < n; i++) diag_j(i) = N(i, i);
+    }
+  }
+  iterative.ok = true;
+  return;
+}
+
+
+arma::mat pglmm_iterative_V_times(const arma::vec& par, const PglmmData& data,
+                                  const arma::mat& B) {
+  return pglmm_V_times(par, data, B, arma::vec(B.n_rows, fill::ones));
+}
+
+
+// diag(V), used for preconditioning
+static arma::vec pglmm_iterative_V_diag(const arma::vec& par, const PglmmData& data) {
+  int q_nonNested = data.q_nonNested();
+  arma::vec dV(data.X.n_rows, fill::ones);
+  if (q_nonNested > 0) {
+    arma::vec d2 = square(vectorise(trans(par.head(q_nonNested)) * data.St));
+    dV += data.iterative.Z2 * d2;
+  }
+  for (int j = 0; j < data.q_Nested(); j++) {
+    double sn = par(q_nonNested + j);
+    dV += (sn * sn) * data.iterative.nested_diag[j];
+  }
+  return dV;
+}
+
+
+/*
+ Columns stop being updated once their residual is below `tol` times the norm
+ of that column of B, and the iterate after `maxit` iterations is used otherwise.
+ */
+arma::mat pglmm_iterative_solve(const arma::vec& par, const PglmmData& data,
+                                const arma::mat& B) {
+
+  const PglmmIterative& it(data.iterative);
+  arma::vec iD = 1 / pglmm_iterative_V_diag(par, data);
+  int k = B.n_cols;
+
+  arma::mat out(B.n_rows, k, fill::zeros);
+  arma::mat R = B;
+  arma::mat Z = R.each_col() % iD;
+  arma::mat P = Z;
+  arma::rowvec rz = sum(R % Z, 0);
+  arma::rowvec thresh = it.tol * sqrt(sum(square(B), 0));
+
+  for (int iter = 0; iter < it.maxit; iter++) {
+    arma::rowvec r_norm = sqrt(sum(square(R), 0));
+    arma::urowvec done = r_norm <= thresh;
+    if (all(done)) break;
+    arma::mat VP = pglmm_iterative_V_times(par, data, P);
+    arma::rowvec alpha = rz / sum(P % VP, 0);
+    for (int c = 0; c < k; c++) {
+      if (done(c)) alpha(c) = 0;
+    }
+    out += P.each_row() % alpha;
+    R -= VP.each_row() % alpha;
+    Z = R.each_col() % iD;
+    arma::rowvec rz_new = sum(R % Z, 0);
+    arma::rowvec beta = rz_new / rz;
+    for (int c = 0; c < k; c++) {
+      if (done(c) || rz(c) == 0) beta(c) = 0;
+    }
+    P = Z + P.each_row() % beta;
+    rz = rz_new;
+  }
+
+  return out;
+}
+
+
+/*
+ Lanczos is run on all probes together, without reorthogonalization, and each
+ probe stops early if its Krylov space is exhausted.
+ */
+double pglmm_iterative_logdet(const arma::vec& par, const PglmmData& data) {
+
+  const PglmmIterative& it(data.iterative);
+  arma::vec dV = pglmm_iterative_V_diag(par, data);
+  arma::vec s = 1 / sqrt(dV);
+  int n = dV.n_elem;
+  int L = it.n_probes;
+  int m = std::min(it.steps, n);
+
+  // Unit-length starting vectors
+  arma::mat Q = pglmm_iterative_probes(n, L, it.seed) / std::sqrt(static_cast<double>(n));
+  arma::mat Q_prev(n, L, fill::zeros);
+  arma::mat alpha(m, L, fill::zeros), beta(m, L, fill::zeros);
+  arma::uvec len(L);
+  len.fill(m);
+  std::vector<bool> active(L, true);
+
+  for (int j = 0; j < m; j++) {
+    arma::mat W = pglmm_iterative_V_times(par, data, Q.each_col() % s);
+    W.each_col() %= s;
+    arma::rowvec a = sum(Q % W, 0);
+    W -= Q.each_row() % a;
+    if (j > 0) W -= Q_prev.each_row() % beta.row(j - 1);
+    arma::rowvec b = sqrt(sum(square(W), 0));
+    alpha.row(j) = a;
+    beta.row(j) = b;
+    bool any_active = false;
+    for (int l = 0; l < L; l++) {
+      if (!active[l]) continue;
+      if (j == m - 1 || b(l) <= 1e-10 * std::abs(a(l))) {
+        len(l) = j + 1;
+        active[l] = false;
+      } else {
+        any_active = true;
+      }
+    }
+    if (!any_active) break;
+    Q_prev = Q;
+    for (int l = 0; l < L; l++) {
+      if (active[l]) {
+        Q.col(l) = W.col(l) / b(l);
+      } else {
+        Q.col(l).zeros();
+      }
+    }
+  }
+
+  // Gauss quadrature from each tridiagonal matrix
+  double quad = 0;
+  for (int l = 0; l < L; l++) {
+    int k = len(l);
+    arma::mat T = diagmat(alpha.col(l).head(k));
+    for (int i = 0; i < k - 1; i++) T(i, i + 1) = T(i + 1, i) = beta(i, l);
+    arma::vec theta;
+    arma::mat E;
+    eig_sym(theta, E, T);
+    theta = clamp(theta, std::numeric_limits<double>::min(), datum::inf);
+    quad += dot(square(trans(E.row(0))), log(theta));
+  }
+
+  return accu(log(dV)) + n * quad / L;
+}
@@ -0,0 +1,736 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <RcppArmadillo.h>
+#include <random>
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "pglmm.h"
+
+using namespace Rcpp;
+using namespace arma;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ MCMC sampler for Bayesian pglmm
+
+ The linear predictor is X B + Zt' u + sum_j F_j v_j, where
+   - u are the non-nested random effects; Zt already includes the Cholesky factors
+     of their covariance matrices, so u ~ N(0, s2_k I) within term k;
+   - F_j F_j' = N_j for nested term j, so v_j ~ N(0, sn_j^2 I).
+ N_j is block diagonal when either of its covariance matrices is an identity
+ matrix (e.g., species within sites), so F_j comes from the eigendecompositions
+ of its connected blocks, which are found from the nonzeros of the sparse N_j.
+ Each of B, the u for each non-nested term, and the v_j for each block of each
+ nested term is updated in turn given the others (a blocked Gibbs sampler),
+ followed by the variances given the latent variables:
+   - Gaussian: the updates are conjugate;
+   - binomial: Polya-Gamma latent variables make the likelihood conditionally
+     Gaussian, so the same updates are used;
+   - poisson: the fixed effects are updated by a Metropolis-Hastings step with
+     the Gaussian proposal from one step of iteratively weighted least squares
+     (Gamerman 1997), and each block of random effects by elliptical slice
+     sampling, which suits their Gaussian priors.
+ Priors are B ~ N(0, 1000 I) and Gamma(1, 5e-5) for the precision of each
+ variance component (and of the residual), as for the defaults in INLA.
+ Each chain uses its own random-number generator, seeded from R's RNG and the
+ chain number, so results don't depend on the number of threads.
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+
+// Prior variance of the fixed effects, and shape and rate of the precisions' prior
+static const double pglmm_mcmc_B_var = 1000;
+static const double pglmm_mcmc_shape = 1;
+static const double pglmm_mcmc_rate = 5e-5;
+
+
+/*
+ Latent variables that enter the linear predictor of observations `rows` as
+ A * gamma, with prior gamma ~ N(0, s2 * I), where s2 is variance component
+ `term`, or `pglmm_mcmc_B_var` for the fixed effects (`term` = -1).
+ A is stored as a sparse matrix for non-nested terms (whose A is the transpose of
+ their rows of Zt) and as a dense one otherwise.
+ */
+class PglmmMcmcBlock {
+public:
+  int term;
+  arma::uvec rows;
+  bool sparse;
+  arma::mat A;
+  arma::sp_mat As;
+  arma::mat AtA;   // A' A, for constant weights (Gaussian models)
+
+  PglmmMcmcBlock(const int& term_, const arma::uvec& rows_, const arma::mat& A_)
+    : term(term_), rows(rows_), sparse(false), A(A_), As(), AtA(A_.t() * A_) {}
+  PglmmMcmcBlock(const int& term_, const arma::uvec& rows_, const arma::sp_mat& As_)
+    : term(term_), rows(rows_), sparse(true), A(), As(As_),
+      AtA(arma::mat(As_.t() * As_)) {}
+
+  uword n_cols() const { return sparse ? As.n_cols : A.n_cols; }
+  // A * g
+  arma::vec times(const arma::vec& g) const {
+    if (sparse) return As * g;
+    return A * g;
+  }
+  // A' * r
+  arma::vec t_times(const arma::vec& r) const {
+    if (sparse) return As.t() * r;
+    return A.t() * r;
+  }
+  // A' diag(w) A
+  arma::mat crossprod(const arma::vec& w) const {
+    if (sparse) {
+      arma::sp_mat wA = As;
+      for (arma::sp_mat::iterator it = wA.begin(); it != wA.end(); ++it) {
+        (*it) *= w(it.row());
+      }
+      return arma::mat(As.t() * wA);
+    }
+    arma::mat wA = A;
+    wA.each_col() %= w;
+    return A.t() * wA;
+  }
+};
+
+
+/*
+ Connected blocks of a symmetric sparse matrix, from union-find on its nonzeros.
+ Observations that aren't in any nonzero are left out.
+ */
+static std::vector<arma::uvec> pglmm_mcmc_components(const arma::sp_mat& N) {
+  int n = N.n_rows;
+  std::vector<int> parent(n);
+  for (int i = 0; i < n; i++) parent[i] = i;
+  auto find_root = [&parent](int i) {
+    while (parent[i] != i) {
+      parent[i] = parent[parent[i]];
+      i = parent[i];
+    }
+    return i;
+  };
+  std::vector<bool> used(n, false);
+  for (arma::sp_mat::const_iterator it = N.begin(); it != N.end(); ++it) {
+    used[it.row()] = used[it.col()] = true;
+    int a = find_root(it.row());
+    int b = find_root(it.col());
+    if (a != b) parent[a] = b;
+  }
+  std::vector<int> index(n, -1);
+  std::vector<std::vector<uword>> comps;
+  for (int i = 0; i < n; i++) {
+    if (!used[i]) continue;
+    int r = find_root(i);
+    if (index[r] < 0) {
+      index[r] = comps.size();
+      comps.push_back(std::vector<uword>());
+    }
+    comps[index[r]].push_back(i);
+  }
+  std::vector<arma::uvec> out;
+  for (const std::vector<uword>& c : comps) out.push_back(arma::uvec(c));
+  return out;
+}
+
+
+static std::vector<PglmmMcmcBlock> pglmm_mcmc_blocks(const PglmmData& data) {
+
+  std::vector<PglmmMcmcBlock> blocks;
+  int n = data.X.n_rows;
+  arma::uvec all_rows = regspace<uvec>(0, n - 1);
+  blocks.push_back(PglmmMcmcBlock(-1, all_rows, data.X));
+
+  // Rows of Zt for non-nested term k are where row k of St is nonzero
+  int q_nonNested = data.q_nonNested();
+  if (q_nonNested > 0) {
+    std::vector<int> term(data.Zt.n_rows, -1), pos(data.Zt.n_rows, -1);
+    std::vector<int> n_k(q_nonNested, 0);
+    for (arma::sp_mat::const_iterator it = data.St.begin(); it != data.St.end(); ++it) {
+      if (term[it.col()] < 0) {
+        term[it.col()] = it.row();
+        pos[it.col()] = n_k[it.row()]++;
+      }
+    }
+    // Nonzeros of each term's block of Zt', kept sparse
+    std::vector<std::vector<uword>> locs(q_nonNested);
+    std::vector<std::vector<double>> vals(q_nonNested);
+    for (arma::sp_mat::const_iterator it = data.Zt.begin(); it != data.Zt.end(); ++it) {
+      int k = term[it.row()];
+      if (k < 0) continue;
+      locs[k].push_back(it.col());
+      locs[k].push_back(pos[it.row()]);
+      vals[k].push_back(*it);
+    }
+    for (int k = 0; k < q_nonNested; k++) {
+      arma::uvec loc_k(locs[k]);
+      arma::umat loc(loc_k.memptr(), 2, vals[k].size());
+      arma::sp_mat A(loc, arma::vec(vals[k]), n, n_k[k]);
+      blocks.push_back(PglmmMcmcBlock(k, all_rows, A));
+    }
+  }
+
+  for (int j = 0; j < data.q_Nested(); j++) {
+    // Augmented terms are only available as products, so these are formed densely
+    arma::sp_mat N = data.is_augmented(j) ? arma::sp_mat(data.nested_dense(j)) :
+      data.nested[j];
+    std::vector<arma::uvec> comps = pglmm_mcmc_components(N);
+    std::vector<int> comp(n, -1), pos(n, -1);
+    std::vector<arma::mat> N_c(comps.size());
+    for (unsigned c = 0; c < comps.size(); c++) {
+      N_c[c].zeros(comps[c].n_elem, comps[c].n_elem);
+      for (uword a = 0; a < comps[c].n_elem; a++) {
+        comp[comps[c](a)] = c;
+        pos[comps[c](a)] = a;
+      }
+    }
+    for (arma::sp_mat::const_iterator it = N.begin(); it != N.end(); ++it) {
+      N_c[comp[it.row()]](pos[it.row()], pos[it.col()]) = *it;
+    }
+    for (unsigned c = 0; c < comps.size(); c++) {
+      arma::vec lambda;
+      arma::mat Q;
+      if (!eig_sym(lambda, Q, N_c[c])) {
+        stop("\nThe eigendecomposition of a nested random term failed.");
+      }
+      arma::uvec keep = find(lambda > 1e-10 * lambda.max());
+      if (keep.n_elem == 0) continue;
+      arma::mat F = Q.cols(keep);
+      F.each_row() %= trans(sqrt(lambda.elem(keep)));
+      blocks.push_back(PglmmMcmcBlock(q_nonNested + j, comps[c], F));
+    }
+  }
+
+  return blocks;
+}
+
+
+
+
+/*
+ ------------------------
+ Polya-Gamma draws
+ ------------------------
+ PG(1, c) is drawn with the exact method of Polson, Scott, and Windle (2013),
+ and PG(b, c) for integer b as a sum of b such draws.
+ */
+
+static const double pglmm_pg_trunc = 0.64;
+
+// log of the standard normal cdf
+static double pglmm_log_pnorm(const double& x) {
+  if (x > -30) return std::log(0.5 * std::erfc(-x / std::sqrt(2.0)));
+  return -0.5 * x * x - std::log(-x) - 0.5 * std::log(2 * M_PI) + std::log1p(-1 / (x * x));
+}
+
+// Coefficients of the alternating series for the density of J*(1, z)
+static double pglmm_pg_a(const int& k, const double& x) {
+  double K = (k + 0.5) * M_PI;
+  if (x > pglmm_pg_trunc) return K * std::exp(-0.5 * K * K * x);
+  if (x <= 0) return 0;
+  return std::exp(-1.5 * (std::log(0.5 * M_PI) + std::log(x)) + std::log(K) -
+                  2.0 * (k + 0.5) * (k + 0.5) / x);
+}
+
+// Inverse Gaussian IG(1 / z, 1), truncated to (0, pglmm_pg_trunc)
+static double pglmm_pg_rtigauss(const double& z, std::mt19937_64& eng) {
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+  std::exponential_distribution<double> expo(1.0);
+  std::normal_distribution<double> norm(0.0, 1.0);
+  const double t = pglmm_pg_trunc;
+  double x = t + 1;
+  if (z * t < 1) {
+    double alpha = 0;
+    while (unif(eng) > alpha) {
+      double e1 = expo(eng), e2 = expo(eng);
+      while (e1 * e1 > 2 * e2 / t) {
+        e1 = expo(eng);
+        e2 = expo(eng);
+      }
+      x = t / ((1 + t * e1) * (1 + t * e1));
+      alpha = std::exp(-0.5 * z * z * x);
+    }
+  } else {
+    double mu = 1 / z;
+    while (x > t) {
+      double y = norm(eng);
+      y *= y;
+      x = mu + 0.5 * mu * mu * y - 0.5 * mu * std::sqrt(4 * mu * y + (mu * y) * (mu * y));
+      if (unif(eng) > mu / (mu + x)) x = mu * mu / x;
+    }
+  }
+  return x;
+}
+
+static double pglmm_pg_draw(const int& b, const double& c, std::mt19937_64& eng) {
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+  std::exponential_distribution<double> expo(1.0);
+  const double t = pglmm_pg_trunc;
+  double z = 0.5 * std::abs(c);
+  double K = 0.125 * M_PI * M_PI + 0.5 * z * z;
+  // Probability of the truncated exponential part of the proposal
+  double x0 = std::log(K) + K * t;
+  double xb = x0 - z + pglmm_log_pnorm(std::sqrt(1 / t) * (t * z - 1));
+  double xa = x0 + z + pglmm_log_pnorm(-std::sqrt(1 / t) * (t * z + 1));
+  double p_exp = 1 / (1 + 4 / M_PI * (std::exp(xb) + std::exp(xa)));
+
+  double out = 0;
+  for (int i = 0; i < b; i++) {
+    bool accepted = false;
+    while (!accepted) {
+      double x = unif(eng) < p_exp ? t + expo(eng) / K : pglmm_pg_rtigauss(z, eng);
+      double s = pglmm_pg_a(0, x);
+      double y = unif(eng) * s;
+      for (int k = 1; ; k++) {
+        if (k % 2 == 1) {
+          s -= pglmm_pg_a(k, x);
+          if (y <= s) {
+            out += 0.25 * x;
+            accepted = true;
+            break;
+          }
+        } else {
+          s += pglmm_pg_a(k, x);
+          if (y > s) break;
+        }
+      }
+    }
+  }
+  return out;
+}
+
+
+
+
+/*
+ ------------------------
+ Chains
+ ------------------------
+ */
+
+/*
+ Data and blocks for the sampler, shared (read-only) by all chains.
+ `lconst` has the constants of each observation's log density.
+ */
+class PglmmMcmcModel {
+public:
+  std::string family;
+  arma::vec Y;
+  arma::vec size;
+  arma::vec lconst;
+  int q;
+  std::vector<PglmmMcmcBlock> blocks;
+
+  PglmmMcmcModel(const PglmmData& data)
+    : family(data.family), Y(data.Y), size(data.totalSize), lconst(data.Y.n_elem),
+      q(data.q_nonNested() + data.q_Nested()), blocks(pglmm_mcmc_blocks(data)) {
+    // lgamma isn't thread-safe, so this is done here
+    for (uword i = 0; i < Y.n_elem; i++) {
+      if (family == "gaussian") {
+        lconst(i) = -0.5 * std::log(2 * M_PI);
+      } else if (family == "binomial") {
+        lconst(i) = std::lgamma(size(i) + 1) - std::lgamma(Y(i) + 1) -
+          std::lgamma(size(i) - Y(i) + 1);
+      } else {
+        lconst(i) = -std::lgamma(Y(i) + 1);
+      }
+    }
+  }
+
+  // Log density of observation i given its linear predictor
+  double log_dens(const uword& i, const double& eta, const double& s2resid) const {
+    if (family == "gaussian") {
+      double r = Y(i) - eta;
+      return lconst(i) - 0.5 * std::log(s2resid) - 0.5 * r * r / s2resid;
+    }
+    if (family == "binomial") {
+      // log(p) = -log(1 + exp(-eta)) and log(1 - p) = -log(1 + exp(eta))
+      double l1p = eta > 0 ? -std::log1p(std::exp(-eta)) : eta - std::log1p(std::exp(eta));
+      double l0p = l1p - eta;
+      return lconst(i) + Y(i) * l1p + (size(i) - Y(i)) * l0p;
+    }
+    return lconst(i) + Y(i) * eta - std::exp(eta);
+  }
+
+  // Fitted value on the response scale
+  double fitted(const uword& i, const double& eta) const {
+    if (family == "gaussian") return eta;
+    if (family == "binomial") return 1 / (1 + std::exp(-eta));
+    return std::exp(eta);
+  }
+};
+
+
+/*
+ Output from one chain.
+ Besides the draws, the sums over draws needed for DIC and WAIC are kept for
+ each observation: `lse` is log(sum(exp(log density))).
+ */
+class PglmmMcmcChain {
+public:
+  arma::mat B;
+  arma::mat s2;
+  arma::vec mu_sum;
+  arma::vec eta_sum;
+  arma::vec lse;
+  arma::vec ll_sum;
+  arma::vec ll2_sum;
+  double dev_sum;
+  double s2resid_sum;
+  std::string error;
+
+  PglmmMcmcChain() : B(), s2(), mu_sum(), eta_sum(), lse(), ll_sum(), ll2_sum(),
+                     dev_sum(0), s2resid_sum(0), error() {}
+};
+
+
+// Draw the block's latent variables given pseudo-observations `z` with weights `w`
+static void pglmm_mcmc_gibbs(const PglmmMcmcBlock& blk, const double& prior_var,
+                             const arma::vec& z, const arma::vec& w, const bool& const_w,
+                             arma::vec& gamma, arma::vec& eta, std::mt19937_64& eng) {
+  std::normal_distribution<double> norm(0.0, 1.0);
+  arma::vec w_r = w.elem(blk.rows);
+  arma::vec r = z.elem(blk.rows) - eta.elem(blk.rows) + blk.times(gamma);
+  arma::mat L = const_w ? arma::mat(w_r(0) * blk.AtA) : blk.crossprod(w_r);
+  L.diag() += 1 / prior_var;
+  arma::mat R;
+  if (!chol(R, L)) throw std::runtime_error("a conditional precision matrix is not positive definite");
+  arma::vec mean = solve(trimatu(R), solve(trimatl(R.t()), blk.t_times(w_r % r)));
+  arma::vec e(gamma.n_elem);
+  for (uword k = 0; k < e.n_elem; k++) e(k) = norm(eng);
+  arma::vec gamma_new = mean + solve(trimatu(R), e);
+  eta.elem(blk.rows) += blk.times(gamma_new - gamma);
+  gamma = gamma_new;
+  return;
+}
+
+
+/*
+ Metropolis-Hastings update of the block's latent variables for poisson models,
+ proposing from the Gaussian given by one step of iteratively weighted least
+ squares from the current value (Gamerman 1997). Near the mode, this is close to
+ the Laplace approximation of the conditional posterior, so most proposals are
+ accepted however strongly the variables are correlated.
+ Far from the mode, almost all proposals are rejected, so during burn-in a
+ rejection is followed by a (damped) step towards the proposal mean instead.
+ */
+
+// Mean and upper Cholesky factor of the precision of the proposal from `gamma`
+static void pglmm_mcmc_iwls_proposal(const PglmmMcmcBlock& blk, const double& prior_var,
+                                     const arma::vec& y_r, const arma::vec& base,
+                                     const arma::vec& gamma, arma::vec& mean,
+                                     arma::mat& R) {
+  arma::vec e = base + blk.times(gamma);
+  arma::vec mu = exp(e);
+  // The working response minus the other terms is A * gamma + (y - mu) / mu,
+  // with weights mu
+  arma::mat L = blk.crossprod(mu);
+  L.diag() += 1 / prior_var;
+  if (!chol(R, L)) throw std::runtime_error("a proposal precision matrix is not positive definite");
+  mean = solve(trimatu(R), solve(trimatl(R.t()),
+                                 blk.t_times(mu % (e - base) + y_r - mu)));
+  return;
+}
+
+// log density of the proposal at `x`, up to a constant
+static double pglmm_mcmc_iwls_log_q(const arma::vec& x, const arma::vec& mean,
+                                    const arma::mat& R) {
+  arma::vec d = R * (x - mean);
+  return accu(log(R.diag())) - 0.5 * dot(d, d);
+}
+
+static void pglmm_mcmc_iwls(const PglmmMcmcBlock& blk, const double& prior_var,
+                            const PglmmMcmcModel& model, const bool& burnin,
+                            arma::vec& gamma, arma::vec& eta, std::mt19937_64& eng) {
+  std::normal_distribution<double> norm(0.0, 1.0);
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+  arma::vec y_r = model.Y.elem(blk.rows);
+  arma::vec base = eta.elem(blk.rows) - blk.times(gamma);
+  auto log_post = [&](const arma::vec& g, arma::vec& e) {
+    e = base + blk.times(g);
+    return accu(y_r % e - exp(e)) - 0.5 * dot(g, g) / prior_var;
+  };
+
+  arma::vec mean, mean_rev, e_cur, e_new;
+  arma::mat R, R_rev;
+  pglmm_mcmc_iwls_proposal(blk, prior_var, y_r, base, gamma, mean, R);
+  arma::vec u(gamma.n_elem);
+  for (uword k = 0; k < u.n_elem; k++) u(k) = norm(eng);
+  arma::vec gamma_new = mean + solve(trimatu(R), u);
+
+  double lp_cur = log_post(gamma, e_cur);
+  double lp_new = log_post(gamma_new, e_new);
+  if (std::isfinite(lp_new)) {
+    pglmm_mcmc_iwls_proposal(blk, prior_var, y_r, base, gamma_new, mean_rev, R_rev);
+    double log_ratio = lp_new - lp_cur + pglmm_mcmc_iwls_log_q(gamma, mean_rev, R_rev) -
+      pglmm_mcmc_iwls_log_q(gamma_new, mean, R);
+    if (std::log(unif(eng)) < log_ratio) {
+      gamma = gamma_new;
+      eta.elem(blk.rows) = e_new;
+      return;
+    }
+  }
+  if (!burnin) return;
+  double t = 1;
+  for (int iter = 0; iter < 20; iter++, t *= 0.5) {
+    arma::vec g = gamma + t * (mean - gamma);
+    if (log_post(g, e_new) > lp_cur) {
+      gamma = g;
+      eta.elem(blk.rows) = e_new;
+      return;
+    }
+  }
+  return;
+}
+
+
+/*
+ Elliptical slice sampling (Murray, Adams, and MacKay 2010) of the block's latent
+ variables for poisson models.
+ The bracket shrinks towards the current value, which is kept if no point is
+ accepted after 100 shrinkages.
+ */
+static void pglmm_mcmc_ess(const PglmmMcmcBlock& blk, const double& prior_var,
+                           const PglmmMcmcModel& model, arma::vec& gamma, arma::vec& eta,
+                           std::mt19937_64& eng) {
+  std::normal_distribution<double> norm(0.0, 1.0);
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+  arma::vec y_r = model.Y.elem(blk.rows);
+  auto loglik = [&y_r](const arma::vec& e) { return accu(y_r % e - exp(e)); };
+
+  arma::vec eta_r = eta.elem(blk.rows);
+  arma::vec base = eta_r - blk.times(gamma);
+  arma::vec nu(gamma.n_elem);
+  for (uword k = 0; k < nu.n_elem; k++) nu(k) = std::sqrt(prior_var) * norm(eng);
+  double log_y = loglik(eta_r) + std::log(unif(eng));
+  double theta = 2 * M_PI * unif(eng);
+  double lo = theta - 2 * M_PI, hi = theta;
+  for (int iter = 0; iter < 100; iter++) {
+    arma::vec g = gamma * std::cos(theta) + nu * std::sin(theta);
+    arma::vec e = base + blk.times(g);
+    if (loglik(e) > log_y) {
+      gamma = g;
+      eta.elem(blk.rows) = e;
+      return;
+    }
+    if (theta < 0) lo = theta; else hi = theta;
+    theta = lo + (hi - lo) * unif(eng);
+  }
+  return;
+}
+
+
+static void pglmm_mcmc_run(const PglmmMcmcModel& model, const arma::vec& B0,
+                           const arma::vec& s2_0, const int& samples, const int& burnin,
+                           const int& thin, std::mt19937_64& eng, PglmmMcmcChain& out) {
+
+  const std::string& family(model.family);
+  const std::vector<PglmmMcmcBlock>& blocks(model.blocks);
+  bool gaussian = family == "gaussian";
+  int n = model.Y.n_elem;
+  int q = model.q;
+
+  // Current state
+  std::vector<arma::vec> gamma(blocks.size());
+  for (unsigned b = 0; b < blocks.size(); b++) gamma[b].zeros(blocks[b].n_cols());
+  gamma[0] = B0;
+  arma::vec s2 = s2_0.head(q);
+  double s2resid = gaussian ? s2_0(q) : 0;
+  arma::vec eta(n), z(n), w(n);
+  std::vector<double> ss(q), m(q);
+
+  out.B.set_size(samples, B0.n_elem);
+  out.s2.set_size(samples, s2_0.n_elem);
+  out.mu_sum.zeros(n);
+  out.eta_sum.zeros(n);
+  out.lse.set_size(n);
+  out.lse.fill(-datum::inf);
+  out.ll_sum.zeros(n);
+  out.ll2_sum.zeros(n);
+
+  int n_iter = burnin + samples * thin;
+  for (int iter = 0; iter < n_iter; iter++) {
+    // Recomputed every sweep so that rounding errors don't accumulate
+    eta.zeros();
+    for (unsigned b = 0; b < blocks.size(); b++) {
+      eta.elem(blocks[b].rows) += blocks[b].times(gamma[b]);
+    }
+
+    if (gaussian) {
+      z = model.Y;
+      w.fill(1 / s2resid);
+    } else if (family == "binomial") {
+      for (int i = 0; i < n; i++) {
+        int size_i = static_cast<int>(std::round(model.size(i)));
+        w(i) = pglmm_pg_draw(size_i, eta(i), eng);
+        z(i) = w(i) > 0 ? (model.Y(i) - 0.5 * model.size(i)) / w(i) : 0;
+      }
+    }
+
+    for (unsigned b = 0; b < blocks.size(); b++) {
+      double prior_var = blocks[b].term < 0 ? pglmm_mcmc_B_var : s2(blocks[b].term);
+      if (family == "poisson" && blocks[b].term < 0) {
+        pglmm_mcmc_iwls(blocks[b], prior_var, model, iter < burnin, gamma[b], eta, eng);
+      } else if (family == "poisson") {
+        pglmm_mcmc_ess(blocks[b], prior_var, model, gamma[b], eta, eng);
+      } else {
+        pglmm_mcmc_gibbs(blocks[b], prior_var, z, w, gaussian, gamma[b], eta, eng);
+      }
+    }
+
+    // Variances given the latent variables
+    std::fill(ss.begin(), ss.end(), 0.0);
+    std::fill(m.begin(), m.end(), 0.0);
+    for (unsigned b = 1; b < blocks.size(); b++) {
+      ss[blocks[b].term] += dot(gamma[b], gamma[b]);
+      m[blocks[b].term] += gamma[b].n_elem;
+    }
+    for (int k = 0; k < q; k++) {
+      std::gamma_distribution<double> prec(pglmm_mcmc_shape + 0.5 * m[k],
+                                           1 / (pglmm_mcmc_rate + 0.5 * ss[k]));
+      s2(k) = 1 / prec(eng);
+    }
+    if (gaussian) {
+      arma::vec r = model.Y - eta;
+      std::gamma_distribution<double> prec(pglmm_mcmc_shape + 0.5 * n,
+                                           1 / (pglmm_mcmc_rate + 0.5 * dot(r, r)));
+      s2resid = 1 / prec(eng);
+    }
+
+    if (iter < burnin || (iter - burnin + 1) % thin != 0) continue;
+    int s = (iter - burnin) / thin;
+    out.B.row(s) = trans(gamma[0]);
+    if (q > 0) out.s2(s, span(0, q - 1)) = trans(s2);
+    if (gaussian) out.s2(s, q) = s2resid;
+    out.s2resid_sum += s2resid;
+    out.eta_sum += eta;
+    for (int i = 0; i < n; i++) {
+      double ll = model.log_dens(i, eta(i), s2resid);
+      double mx = std::max(out.lse(i), ll);
+      out.lse(i) = mx + std::log(std::exp(out.lse(i) - mx) + std::exp(ll - mx));
+      out.ll_sum(i) += ll;
+      out.ll2_sum(i) += ll * ll;
+      out.dev_sum -= 2 * ll;
+      out.mu_sum(i) += model.fitted(i, eta(i));
+    }
+  }
+
+  return;
+}
+
+
+
+
+//' Inner function for the MCMC sampler for Bayesian pglmm.
+//'
+//' @param B0 Starting values of the fixed effects.
+//' @param s2_0 Starting values of the variance components (followed by the
+//'   residual variance for gaussian models).
+//' @param samples Number of draws kept from each chain.
+//' @param burnin Number of iterations discarded at the start of each chain.
+//' @param thin Keep every `thin`-th iteration after `burnin`.
+//' @param chains Number of chains, which are run in parallel with `n_threads > 1`.
+//'
+//' @return a list with the draws of B and the variances (one row per draw),
+//'   the chain of each draw, the posterior mean of the fitted values, and DIC and WAIC.
+//' @noRd
+//' @name pglmm_mcmc_cpp
+//'
+//[[Rcpp::export]]
+List pglmm_mcmc_cpp(const arma::mat& X, const arma::vec& Y,
+                    const arma::sp_mat& Zt, const arma::sp_mat& St,
+                    const List& nested, const std::string family,
+                    const arma::vec& totalSize, const arma::vec& B0,
+                    const arma::vec& s2_0, const int samples, const int burnin,
+                    const int thin, const int chains, const int n_threads) {
+
+  PglmmData data(X, Y, Zt, St, nested, false, family, totalSize);
+  int q = data.q_nonNested() + data.q_Nested();
+  bool gaussian = family == "gaussian";
+  if (static_cast<int>(s2_0.n_elem) != q + (gaussian ? 1 : 0) ||
+      B0.n_elem != X.n_cols) {
+    stop("\nINTERNAL ERROR: wrong number of starting values in pglmm_mcmc_cpp");
+  }
+  const PglmmMcmcModel model(data);
+
+  // Seed from R's RNG, so results follow `set.seed`
+  uint32_t seed = static_cast<uint32_t>(R::unif_rand() *
+    std::numeric_limits<uint32_t>::max());
+
+  std::vector<PglmmMcmcChain> out(chains);
+  int n_thr = std::max(std::min(n_threads, chains), 1);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_thr)
+#endif
+  for (int c = 0; c < chains; c++) {
+    try {
+      std::seed_seq seq{seed, static_cast<uint32_t>(c)};
+      std::mt19937_64 eng(seq);
+      pglmm_mcmc_run(model, B0, s2_0, samples, burnin, thin, eng, out[c]);
+    } catch (std::exception& e) {
+      out[c].error = e.what();
+    } catch (...) {
+      out[c].error = "unknown error";
+    }
+  }
+  for (int c = 0; c < chains; c++) {
+    if (out[c].error != "") stop("\nMCMC failed in chain " + std::to_string(c + 1) +
+                                 ": " + out[c].error);
+  }
+
+  // Combine chains
+  int n = Y.n_elem;
+  int S = samples * chains;
+  arma::mat B_draws(S, X.n_cols), s2_draws(S, s2_0.n_elem);
+  IntegerVector chain(S);
+  arma::vec mu(n, fill::zeros), eta_mean(n, fill::zeros);
+  arma::vec lse(n), ll_sum(n, fill::zeros), ll2_sum(n, fill::zeros);
+  lse.fill(-datum::inf);
+  double dev_mean = 0, s2resid_mean = 0;
+  for (int c = 0; c < chains; c++) {
+    B_draws.rows(c * samples, (c + 1) * samples - 1) = out[c].B;
+    s2_draws.rows(c * samples, (c + 1) * samples - 1) = out[c].s2;
+    for (int s = 0; s < samples; s++) chain[c * samples + s] = c + 1;
+    mu += out[c].mu_sum / S;
+    eta_mean += out[c].eta_sum / S;
+    for (int i = 0; i < n; i++) {
+      double mx = std::max(lse(i), out[c].lse(i));
+      lse(i) = mx + std::log(std::exp(lse(i) - mx) + std::exp(out[c].lse(i) - mx));
+    }
+    ll_sum += out[c].ll_sum;
+    ll2_sum += out[c].ll2_sum;
+    dev_mean += out[c].dev_sum / S;
+    s2resid_mean += out[c].s2resid_sum / S;
+  }
+
+  // DIC with the deviance at the posterior means, and WAIC as in Gelman et al. (2014)
+  double dev_at_mean = 0;
+  for (int i = 0; i < n; i++) dev_at_mean -= 2 * model.log_dens(i, eta_mean(i), s2resid_mean);
+  double DIC = 2 * dev_mean - dev_at_mean;
+  double lppd = accu(lse) - n * std::log(static_cast<double>(S));
+  double p_waic = 0;
+  if (S > 1) {
+    p_waic = accu(ll2_sum - ll_sum % ll_sum / S) / (S - 1);
+  }
+  double WAIC = -2 * (lppd - p_waic);
+
+  return List::create(_["B"] = B_draws, _["s2"] = s2_draws, _["chain"] = chain,
+                      _["mu"] = mu, _["DIC"] = DIC, _["WAIC"] = WAIC);
+}
@@ -0,0 +1,226 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <RcppArmadillo.h>
+
+#include "pglmm.h"
+
+using namespace Rcpp;
+using namespace arma;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Persistent pglmm model handle
+
+ The functions `pglmm_gaussian_LL_cpp`, `pglmm_LL_cpp`, `pglmm_iV_logdetV_cpp`,
+ and `pglmm_V` convert all their inputs (including every matrix in `nested`) on
+ each call.
+ A handle wraps a `PglmmData` object in an external pointer, so a fitted model's
+ inputs are converted (and the sparse ordering, Kronecker structure, and Gram
+ blocks found) once, and then reused by every call that's given the handle.
+ Handles don't survive saving and reloading, so they're made as needed by
+ `pglmm_cpp_model` in R rather than stored in fitted objects.
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+
+// Inverse weights of the observations in V (ones for Gaussian models)
+static arma::vec pglmm_model_weights(const PglmmData& data) {
+  if (data.family == "gaussian") return arma::vec(data.X.n_rows, fill::ones);
+  return pglmm_inv_weights(data);
+}
+
+// Gram blocks for the current response (Y for Gaussian models, H otherwise)
+static void pglmm_model_set_gram(PglmmData& data) {
+  if (data.family == "gaussian") {
+    data.set_gram(pglmm_model_weights(data), data.Y);
+  } else if (data.mu.n_elem > 0 && data.H.n_elem > 0) {
+    data.set_gram(pglmm_inv_weights(data), data.H);
+  } else {
+    data.gram = PglmmGram();
+  }
+  return;
+}
+
+
+// Make a model handle. `mu` and `H` are only used for binomial and poisson models.
+// [[Rcpp::export]]
+SEXP pglmm_model_cpp(const arma::mat& X, const arma::vec& Y,
+                     const arma::sp_mat& Zt, const arma::sp_mat& St,
+                     const List& nested, bool REML,
+                     const std::string family, arma::vec totalSize,
+                     const arma::vec& mu, const arma::vec& H) {
+  XPtr<PglmmData> model(new PglmmData(X, Y, Zt, St, nested, REML, family, totalSize),
+                        true);
+  model->mu = mu;
+  model->H = H;
+  pglmm_model_set_gram(*model);
+  return model;
+}
+
+// Update the mean and working response of a binomial or poisson model handle
+// [[Rcpp::export]]
+void pglmm_model_update(SEXP xptr, const arma::vec& mu, const arma::vec& H) {
+  XPtr<PglmmData> model(xptr);
+  model->mu = mu;
+  model->H = H;
+  pglmm_model_set_gram(*model);
+  return;
+}
+
+// Log likelihood function (without constants), as from `pglmm_gaussian_LL_cpp`
+// or `pglmm_LL_cpp`
+// [[Rcpp::export]]
+double pglmm_model_LL(NumericVector par, SEXP xptr, bool verbose) {
+  XPtr<PglmmData> model(xptr);
+  arma::vec par_ = as<arma::vec>(par);
+  double LL;
+  if (model->family == "gaussian") {
+    LL = pglmm_gaussian_LL_core(par_, *model);
+  } else {
+    LL = pglmm_LL_core(par_, *model);
+  }
+  if (verbose) pglmm_print_eval(LL, abs(par_));
+  return LL;
+}
+
+// Output from a Gaussian model, as from `pglmm_gaussian_LL_calc_cpp`
+// [[Rcpp::export]]
+List pglmm_model_gaussian_calc(NumericVector par, SEXP xptr) {
+  XPtr<PglmmData> model(xptr);
+  if (model->family != "gaussian") stop("\nThe pglmm model handle isn't gaussian.");
+  return pglmm_gaussian_LL_calc_core(as<arma::vec>(par), *model);
+}
+
+// iV and log|V|, as from `pglmm_iV_logdetV_cpp`
+// [[Rcpp::export]]
+List pglmm_model_iV_logdetV(NumericVector par, SEXP xptr, bool logdet) {
+  XPtr<PglmmData> model(xptr);
+  arma::sp_mat iV;
+  double logdetV;
+  pglmm_iV_logdetV_core(as<arma::vec>(par), *model, logdet, iV, logdetV);
+  if (logdet) return List::create(_["iV"] = iV, _["logdetV"] = logdetV);
+  return List::create(_["iV"] = iV);
+}
+
+// V, as from `pglmm_V`
+// [[Rcpp::export]]
+arma::sp_mat pglmm_model_V(NumericVector par, SEXP xptr, bool missing_mu) {
+  XPtr<PglmmData> model(xptr);
+  return pglmm_V_core(as<arma::vec>(par), *model, missing_mu);
+}
+
+/*
+ A fitted model's iV in factored form.
+ Fitted objects don't store iV, which is a dense n x n matrix; instead, these
+ apply iV(par) = V(par)^-1 to a matrix, or give its diagonal, log|V(par)|, or
+ V(par) times a matrix, from the same factorization used for fitting.
+ The dense iV is only made if asked for (`pglmm_model_iV_dense`).
+ For Gaussian models, `par` excludes the residual standard deviation, and V(par)
+ has unit residual variance.
+ */
+// [[Rcpp::export]]
+arma::mat pglmm_model_iV_times(NumericVector par, SEXP xptr, const arma::mat& B) {
+  XPtr<PglmmData> model(xptr);
+  const PglmmVinv Vinv(as<arma::vec>(par), *model, pglmm_model_weights(*model));
+  return Vinv.times(B);
+}
+
+// [[Rcpp::export]]
+arma::vec pglmm_model_iV_diag(NumericVector par, SEXP xptr) {
+  XPtr<PglmmData> model(xptr);
+  const PglmmVinv Vinv(as<arma::vec>(par), *model, pglmm_model_weights(*model));
+  return Vinv.diag();
+}
+
+// [[Rcpp::export]]
+double pglmm_model_logdetV(NumericVector par, SEXP xptr) {
+  XPtr<PglmmData> model(xptr);
+  const PglmmVinv Vinv(as<arma::vec>(par), *model, pglmm_model_weights(*model));
+  return Vinv.logdetV;
+}
+
+// [[Rcpp::export]]
+arma::mat pglmm_model_V_times(NumericVector par, SEXP xptr, const arma::mat& B) {
+  XPtr<PglmmData> model(xptr);
+  return pglmm_V_times(as<arma::vec>(par), *model, B, pglmm_model_weights(*model));
+}
+
+// [[Rcpp::export]]
+arma::mat pglmm_model_iV_dense(NumericVector par, SEXP xptr) {
+  XPtr<PglmmData> model(xptr);
+  const PglmmVinv Vinv(as<arma::vec>(par), *model, pglmm_model_weights(*model));
+  return Vinv.dense();
+}
+
+/*
+ Predictions of a Gaussian model to the nearest node, as from
+ `pglmm_predicted_values(x, gaussian.pred = "nearest_node")`.
+ These are R + v iV R for residuals R, where v is V with each diagonal element
+ replaced by the largest off-diagonal one in its row, so they're
+ R + (d - diag(V)) % (iV R) for those largest elements d.
+ V is only used in products, a block of columns at a time (V is symmetric, so
+ columns are used for rows), so memory is linear in the number of observations.
+ These don't depend on s2resid, so only `par` (without it) is needed.
+ */
+// [[Rcpp::export]]
+arma::vec pglmm_model_gaussian_nearest(NumericVector par, SEXP xptr,
+                                       const arma::vec& R) {
+  XPtr<PglmmData> model(xptr);
+  arma::vec par_ = as<arma::vec>(par);
+  const arma::vec a0 = pglmm_model_weights(*model);
+  const PglmmVinv Vinv(par_, *model, a0);
+  uword n = a0.n_elem;
+  uword block = 64;
+  arma::vec d(n), V_diag(n);
+  for (uword c0 = 0; c0 < n; c0 += block) {
+    uword c1 = std::min(n, c0 + block) - 1;
+    arma::mat E(n, c1 - c0 + 1, fill::zeros);
+    for (uword c = c0; c <= c1; c++) E(c, c - c0) = 1;
+    arma::mat VE = pglmm_V_times(par_, *model, E, a0);
+    for (uword c = c0; c <= c1; c++) {
+      V_diag(c) = VE(c, c - c0);
+      VE(c, c - c0) = -arma::datum::inf;
+      d(c) = VE.col(c - c0).max();
+    }
+  }
+  arma::vec Rhat = R + (d - V_diag) % Vinv.times(R);
+  return Rhat;
+}
+
+/*
+ Leave-one-out predictions of `H` for a Gaussian model, as from
+ `pglmm_gaussian_predict`, but without a dense iV: iV is applied in factored form,
+ and its diagonal found directly.
+ These don't depend on s2resid, so only `par` (without it) is needed.
+ */
+// [[Rcpp::export]]
+arma::vec pglmm_model_gaussian_predict(NumericVector par, SEXP xptr,
+                                       const arma::vec& H) {
+  XPtr<PglmmData> model(xptr);
+  const PglmmVinv Vinv(as<arma::vec>(par), *model,
+                       arma::vec(model->X.n_rows, fill::ones));
+  arma::vec h = H - Vinv.times(H) / Vinv.diag();
+  return h;
+}
+
+// Profile likelihoods for each random term, as from `pglmm_profile_LRT_cpp`
+// [[Rcpp::export]]
+List pglmm_model_profile_LRT(NumericVector par, SEXP xptr, bool reoptimize,
+                             std::string optimizer, int maxit, double reltol,
+                             int n_threads) {
+  XPtr<PglmmData> model(xptr);
+  if (model->family == "gaussian" || model->H.n_elem == 0) {
+    stop("\nThe pglmm model handle needs to be binomial or poisson, with `mu` and `H`.");
+  }
+  return pglmm_profile_LRT_core(as<arma::vec>(par), *model, reoptimize, optimizer,
+                                maxit, reltol, n_threads);
+}
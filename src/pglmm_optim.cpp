@@ -0,0 +1,699 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <RcppArmadillo.h>
+#include <R_ext/Applic.h>
+#include <cmath>
+#include <limits>
+#include <vector>
+#include <string>
+#include <stdexcept>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/*
+ This header defines (non-inline) functions that look up nlopt's C API from the
+ nloptr package, so it should only be included in this file.
+ */
+#include <nloptrAPI.h>
+
+#include "pglmm.h"
+
+using namespace Rcpp;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Optimizers for pglmm variance components
+
+ These do the same thing as calling `stats::optim` or `nloptr::nloptr` from R,
+ but the objective function is called directly from C++.
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+
+// Value returned by `nelder_mead` when the function can't be evaluated at `par`
+#define NM_INIT_FAIL -1
+
+
+/*
+ Nelder-Mead minimization ported from `nmmin` in R's `src/appl/optim.c`, with
+ the defaults from `stats::optim` (alpha = 1, beta = 0.5, gamma = 2).
+ Unlike `nmmin`, this doesn't use the R API, so it's safe to use from
+ multiple threads.
+
+ On input, `par` contains starting values. On output, it contains the best
+ parameters found, and `value` contains the function value there.
+ Returns the convergence code, which is the same as for `stats::optim`
+ (0 = converged, 1 = `maxit` reached, 10 = degenerate simplex), or
+ `NM_INIT_FAIL` if `fn` isn't finite at the starting values.
+ */
+int nelder_mead(const pglmm_objective& fn,
+                arma::vec& par,
+                double& value,
+                int& fncount,
+                const int& maxit,
+                const double& abstol,
+                const double& reltol) {
+
+  const double big = 1.0e+35;
+  const double alpha = 1.0, bet = 0.5, gamm = 2.0;
+
+  int n = par.n_elem;
+  arma::vec Bvec = par;
+  int fail = 0;
+
+  if (maxit <= 0) {
+    value = fn(Bvec);
+    fncount = 0;
+    return 0;
+  }
+
+  // Simplex vertices are in columns, with function values in the last row
+  arma::mat P(n + 1, n + 2);
+  double f = fn(Bvec);
+  if (!std::isfinite(f)) {
+    fncount = 1;
+    return NM_INIT_FAIL;
+  }
+
+  int funcount = 1;
+  double convtol = reltol * (std::abs(f) + reltol);
+  int n1 = n + 1;
+  int C = n + 2;
+  P(n1 - 1, 0) = f;
+  for (int i = 0; i < n; i++) P(i, 0) = Bvec(i);
+
+  int L = 1, H;
+  double size = 0.0;
+
+  double step = 0.0;
+  for (int i = 0; i < n; i++) {
+    if (0.1 * std::abs(Bvec(i)) > step) step = 0.1 * std::abs(Bvec(i));
+  }
+  if (step == 0.0) step = 0.1;
+  for (int j = 2; j <= n1; j++) {
+    for (int i = 0; i < n; i++) P(i, j - 1) = Bvec(i);
+    double trystep = step;
+    while (P(j - 2, j - 1) == Bvec(j - 2)) {
+      P(j - 2, j - 1) = Bvec(j - 2) + trystep;
+      trystep *= 10;
+    }
+    size += trystep;
+  }
+  double oldsize = size;
+  bool calcvert = true;
+  double VH, VL, VR, temp;
+
+  do {
+    if (calcvert) {
+      for (int j = 0; j < n1; j++) {
+        if (j + 1 != L) {
+          for (int i = 0; i < n; i++) Bvec(i) = P(i, j);
+          f = fn(Bvec);
+          if (!std::isfinite(f)) f = big;
+          funcount++;
+          P(n1 - 1, j) = f;
+        }
+      }
+      calcvert = false;
+    }
+
+    VL = P(n1 - 1, L - 1);
+    VH = VL;
+    H = L;
+
+    for (int j = 1; j <= n1; j++) {
+      if (j != L) {
+        f = P(n1 - 1, j - 1);
+        if (f < VL) {
+          L = j;
+          VL = f;
+        }
+        if (f > VH) {
+          H = j;
+          VH = f;
+        }
+      }
+    }
+
+    if (VH <= VL + convtol || VL <= abstol) break;
+
+    for (int i = 0; i < n; i++) {
+      temp = -P(i, H - 1);
+      for (int j = 0; j < n1; j++) temp += P(i, j);
+      P(i, C - 1) = temp / n;
+    }
+    for (int i = 0; i < n; i++) {
+      Bvec(i) = (1.0 + alpha) * P(i, C - 1) - alpha * P(i, H - 1);
+    }
+    f = fn(Bvec);
+    if (!std::isfinite(f)) f = big;
+    funcount++;
+    VR = f;
+    if (VR < VL) { // extension
+      P(n1 - 1, C - 1) = f;
+      for (int i = 0; i < n; i++) {
+        f = gamm * Bvec(i) + (1 - gamm) * P(i, C - 1);
+        P(i, C - 1) = Bvec(i);
+        Bvec(i) = f;
+      }
+      f = fn(Bvec);
+      if (!std::isfinite(f)) f = big;
+      funcount++;
+      if (f < VR) {
+        for (int i = 0; i < n; i++) P(i, H - 1) = Bvec(i);
+        P(n1 - 1, H - 1) = f;
+      } else {
+        for (int i = 0; i < n; i++) P(i, H - 1) = P(i, C - 1);
+        P(n1 - 1, H - 1) = VR;
+      }
+    } else { // reduction
+      if (VR < VH) {
+        for (int i = 0; i < n; i++) P(i, H - 1) = Bvec(i);
+        P(n1 - 1, H - 1) = VR;
+      }
+      for (int i = 0; i < n; i++) {
+        Bvec(i) = (1 - bet) * P(i, H - 1) + bet * P(i, C - 1);
+      }
+      f = fn(Bvec);
+      if (!std::isfinite(f)) f = big;
+      funcount++;
+
+      if (f < P(n1 - 1, H - 1)) {
+        for (int i = 0; i < n; i++) P(i, H - 1) = Bvec(i);
+        P(n1 - 1, H - 1) = f;
+      } else if (VR >= VH) { // shrink
+        calcvert = true;
+        size = 0.0;
+        for (int j = 0; j < n1; j++) {
+          if (j + 1 != L) {
+            for (int i = 0; i < n; i++) {
+              P(i, j) = bet * (P(i, j) - P(i, L - 1)) + P(i, L - 1);
+              size += std::abs(P(i, j) - P(i, L - 1));
+            }
+          }
+        }
+        if (size < oldsize) {
+          oldsize = size;
+        } else {
+          fail = 10;
+          break;
+        }
+      }
+    }
+
+  } while (funcount <= maxit);
+
+  value = P(n1 - 1, L - 1);
+  for (int i = 0; i < n; i++) par(i) = P(i, L - 1);
+  if (funcount > maxit) fail = 1;
+  fncount = funcount;
+
+  return fail;
+}
+
+
+
+
+/*
+ Nelder-Mead with speculative evaluations, for objectives that are slow to evaluate.
+ This takes exactly the same steps as `nelder_mead`, so the results are the same,
+ but for each step, the reflection, the expansion, and both possible contractions
+ are evaluated at once on separate threads (as many of them as there are threads),
+ before knowing which of them are needed.
+ The vertices of the initial and shrunk simplices are also evaluated in parallel.
+ `fns` has one objective per thread, each using its own copy of the data, and
+ `fns[0]` is only called from the calling thread.
+ Only the evaluations that `nelder_mead` would make count towards `maxit`.
+ */
+
+// Values at each column of `pts`, spread over the threads, with non-finite values
+// replaced by `big`
+static arma::vec nm_eval_parallel(const std::vector<pglmm_objective>& fns,
+                                  const arma::mat& pts, const double& big) {
+  int k = pts.n_cols;
+  int n_thr = std::min(static_cast<int>(fns.size()), k);
+  arma::vec vals(k);
+  // Exceptions can't leave an OpenMP region, so they're stored instead:
+  std::vector<std::string> errors(k);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) num_threads(n_thr)
+#endif
+  for (int i = 0; i < k; i++) {
+#ifdef _OPENMP
+    const pglmm_objective& fn(fns[omp_get_thread_num()]);
+#else
+    const pglmm_objective& fn(fns[0]);
+#endif
+    try {
+      arma::vec x = pts.col(i);
+      double f = fn(x);
+      vals(i) = std::isfinite(f) ? f : big;
+    } catch (std::exception& e) {
+      errors[i] = e.what();
+    }
+  }
+  for (int i = 0; i < k; i++) {
+    if (!errors[i].empty()) throw std::runtime_error(errors[i]);
+  }
+  return vals;
+}
+
+int nelder_mead_parallel(const std::vector<pglmm_objective>& fns,
+                         arma::vec& par,
+                         double& value,
+                         int& fncount,
+                         const int& maxit,
+                         const double& abstol,
+                         const double& reltol) {
+
+  const double big = 1.0e+35;
+  const double alpha = 1.0, bet = 0.5, gamm = 2.0;
+
+  int n = par.n_elem;
+  arma::vec Bvec = par;
+  int fail = 0;
+  int n_spec = std::min(static_cast<int>(fns.size()), 4);
+
+  if (maxit <= 0) {
+    value = fns[0](Bvec);
+    fncount = 0;
+    return 0;
+  }
+
+  // Simplex vertices are in columns, with function values in the last row
+  arma::mat P(n + 1, n + 2);
+  double f = fns[0](Bvec);
+  if (!std::isfinite(f)) {
+    fncount = 1;
+    return NM_INIT_FAIL;
+  }
+
+  int funcount = 1;
+  double convtol = reltol * (std::abs(f) + reltol);
+  int n1 = n + 1;
+  int C = n + 2;
+  P(n1 - 1, 0) = f;
+  for (int i = 0; i < n; i++) P(i, 0) = Bvec(i);
+
+  int L = 1, H;
+  double size = 0.0;
+
+  double step = 0.0;
+  for (int i = 0; i < n; i++) {
+    if (0.1 * std::abs(Bvec(i)) > step) step = 0.1 * std::abs(Bvec(i));
+  }
+  if (step == 0.0) step = 0.1;
+  for (int j = 2; j <= n1; j++) {
+    for (int i = 0; i < n; i++) P(i, j - 1) = Bvec(i);
+    double trystep = step;
+    while (P(j - 2, j - 1) == Bvec(j - 2)) {
+      P(j - 2, j - 1) = Bvec(j - 2) + trystep;
+      trystep *= 10;
+    }
+    size += trystep;
+  }
+  double oldsize = size;
+  bool calcvert = true;
+  double VH, VL, VR;
+
+  do {
+    if (calcvert) {
+      std::vector<int> idx;
+      for (int j = 0; j < n1; j++) {
+        if (j + 1 != L) idx.push_back(j);
+      }
+      arma::mat pts(n, idx.size());
+      for (unsigned k = 0; k < idx.size(); k++) pts.col(k) = P.col(idx[k]).head(n);
+      arma::vec vals = nm_eval_parallel(fns, pts, big);
+      for (unsigned k = 0; k < idx.size(); k++) P(n1 - 1, idx[k]) = vals(k);
+      funcount += idx.size();
+      calcvert = false;
+    }
+
+    VL = P(n1 - 1, L - 1);
+    VH = VL;
+    H = L;
+
+    for (int j = 1; j <= n1; j++) {
+      if (j != L) {
+        f = P(n1 - 1, j - 1);
+        if (f < VL) {
+          L = j;
+          VL = f;
+        }
+        if (f > VH) {
+          H = j;
+          VH = f;
+        }
+      }
+    }
+
+    if (VH <= VL + convtol || VL <= abstol) break;
+
+    for (int i = 0; i < n; i++) {
+      double temp = -P(i, H - 1);
+      for (int j = 0; j < n1; j++) temp += P(i, j);
+      P(i, C - 1) = temp / n;
+    }
+
+    // Reflection, expansion, and contractions towards the reflection and towards
+    // the worst vertex, in the order they're likely to be needed
+    arma::mat cand(n, 4);
+    for (int i = 0; i < n; i++) {
+      double refl = (1.0 + alpha) * P(i, C - 1) - alpha * P(i, H - 1);
+      cand(i, 0) = refl;
+      cand(i, 1) = gamm * refl + (1 - gamm) * P(i, C - 1);
+      cand(i, 2) = (1 - bet) * refl + bet * P(i, C - 1);
+      cand(i, 3) = (1 - bet) * P(i, H - 1) + bet * P(i, C - 1);
+    }
+    arma::vec cand_vals(4);
+    std::vector<bool> evaluated(4, false);
+    cand_vals.head(n_spec) = nm_eval_parallel(fns, cand.head_cols(n_spec), big);
+    for (int k = 0; k < n_spec; k++) evaluated[k] = true;
+    auto cand_value = [&](const int& k) {
+      if (!evaluated[k]) {
+        cand_vals(k) = nm_eval_parallel(fns, cand.col(k), big)(0);
+        evaluated[k] = true;
+      }
+      return cand_vals(k);
+    };
+
+    VR = cand_value(0);
+    funcount++;
+    if (VR < VL) { // extension
+      f = cand_value(1);
+      funcount++;
+      if (f < VR) {
+        P.col(H - 1).head(n) = cand.col(1);
+        P(n1 - 1, H - 1) = f;
+      } else {
+        P.col(H - 1).head(n) = cand.col(0);
+        P(n1 - 1, H - 1) = VR;
+      }
+    } else { // reduction
+      int k_contr = 3;
+      if (VR < VH) {
+        P.col(H - 1).head(n) = cand.col(0);
+        P(n1 - 1, H - 1) = VR;
+        k_contr = 2;
+      }
+      f = cand_value(k_contr);
+      funcount++;
+
+      if (f < P(n1 - 1, H - 1)) {
+        P.col(H - 1).head(n) = cand.col(k_contr);
+        P(n1 - 1, H - 1) = f;
+      } else if (VR >= VH) { // shrink
+        calcvert = true;
+        size = 0.0;
+        for (int j = 0; j < n1; j++) {
+          if (j + 1 != L) {
+            for (int i = 0; i < n; i++) {
+              P(i, j) = bet * (P(i, j) - P(i, L - 1)) + P(i, L - 1);
+              size += std::abs(P(i, j) - P(i, L - 1));
+            }
+          }
+        }
+        if (size < oldsize) {
+          oldsize = size;
+        } else {
+          fail = 10;
+          break;
+        }
+      }
+    }
+
+  } while (funcount <= maxit);
+
+  value = P(n1 - 1, L - 1);
+  for (int i = 0; i < n; i++) par(i) = P(i, L - 1);
+  if (funcount > maxit) fail = 1;
+  fncount = funcount;
+
+  return fail;
+}
+
+
+
+
+/*
+ L-BFGS-B without bounds, using R's `lbfgsb` function with the defaults from
+ `stats::optim` (m = 5, factr = 1e7, pgtol = 0) and the same finite-difference
+ gradient (step size of 1e-3).
+ This uses the R API, so only use it from the main thread.
+ */
+
+// Info passed to the `lbfgsb` callbacks
+class LbfgsbInfo {
+public:
+  const pglmm_objective* fn;
+  std::string error;
+  LbfgsbInfo(const pglmm_objective* fn_) : fn(fn_), error() {}
+};
+
+double lbfgsb_fn(int n, double* x, void* ex) {
+  LbfgsbInfo* info = static_cast<LbfgsbInfo*>(ex);
+  // Exceptions shouldn't pass through R's C code, so they're stored instead:
+  if (!info->error.empty()) return std::numeric_limits<double>::max();
+  double val;
+  try {
+    arma::vec par(x, n);
+    val = (*(info->fn))(par);
+  } catch (std::exception& e) {
+    info->error = e.what();
+    return std::numeric_limits<double>::max();
+  }
+  if (!std::isfinite(val)) {
+    info->error = "L-BFGS-B needs finite values of 'fn'";
+    return std::numeric_limits<double>::max();
+  }
+  return val;
+}
+
+void lbfgsb_gr(int n, double* x, double* df, void* ex) {
+  LbfgsbInfo* info = static_cast<LbfgsbInfo*>(ex);
+  const double ndeps = 1e-3;
+  for (int i = 0; i < n; i++) {
+    double xi = x[i];
+    x[i] = xi + ndeps;
+    double val1 = lbfgsb_fn(n, x, ex);
+    x[i] = xi - ndeps;
+    double val2 = lbfgsb_fn(n, x, ex);
+    df[i] = (val1 - val2) / (2 * ndeps);
+    if (!std::isfinite(df[i]) && info->error.empty()) {
+      info->error = "non-finite finite-difference value [" +
+        std::to_string(i + 1) + "]";
+    }
+    x[i] = xi;
+  }
+  return;
+}
+
+int lbfgsb_optim(const pglmm_objective& fn,
+                 arma::vec& par,
+                 double& value,
+                 int& fncount,
+                 int& grcount,
+                 const int& maxit,
+                 std::string& error) {
+
+  int n = par.n_elem;
+  std::vector<double> x(par.begin(), par.end());
+  std::vector<double> lower(n, R_NegInf), upper(n, R_PosInf);
+  std::vector<int> nbd(n, 0);
+  char msg[60];
+  int fail = 0;
+
+  LbfgsbInfo info(&fn);
+
+  lbfgsb(n, 5, &x[0], &lower[0], &upper[0], &nbd[0], &value,
+         lbfgsb_fn, lbfgsb_gr, &fail, static_cast<void*>(&info),
+         1e7, 0, &fncount, &grcount, maxit, msg, 0, 10);
+
+  for (int i = 0; i < n; i++) par(i) = x[i];
+  error = info.error;
+
+  return fail;
+}
+
+
+
+
+/*
+ nlopt minimization using the same options that `pglmm` previously passed to
+ `nloptr::nloptr`.
+ The convergence code is nlopt's return value, and `iters` is the number
+ of function evaluations (as for the `iterations` output from `nloptr`).
+ */
+
+// Info passed to the nlopt callback
+class NloptInfo {
+public:
+  const pglmm_objective* fn;
+  nlopt_opt opt;
+  int iters;
+  std::string error;
+  NloptInfo(const pglmm_objective* fn_, nlopt_opt opt_)
+    : fn(fn_), opt(opt_), iters(0), error() {}
+};
+
+double nlopt_fn(unsigned n, const double* x, double* grad, void* f_data) {
+  NloptInfo* info = static_cast<NloptInfo*>(f_data);
+  info->iters++;
+  double val;
+  // Exceptions shouldn't pass through nlopt's C code, so they're stored instead:
+  try {
+    arma::vec par(x, n);
+    val = (*(info->fn))(par);
+  } catch (std::exception& e) {
+    info->error = e.what();
+    nlopt_force_stop(info->opt);
+    return 0;
+  }
+  return val;
+}
+
+int nlopt_optim(const pglmm_objective& fn,
+                arma::vec& par,
+                double& value,
+                int& iters,
+                const nlopt_algorithm& algorithm,
+                const int& maxit,
+                const double& reltol,
+                std::string& error) {
+
+  unsigned n = par.n_elem;
+
+  nlopt_opt opt = nlopt_create(algorithm, n);
+  NloptInfo info(&fn, opt);
+
+  nlopt_set_min_objective(opt, nlopt_fn, static_cast<void*>(&info));
+  nlopt_set_ftol_rel(opt, reltol);
+  nlopt_set_ftol_abs(opt, reltol);
+  nlopt_set_xtol_rel(opt, 0.0001);
+  nlopt_set_maxeval(opt, maxit);
+
+  std::vector<double> x(par.begin(), par.end());
+  nlopt_result status = nlopt_optimize(opt, &x[0], &value);
+  nlopt_destroy(opt);
+
+  for (unsigned i = 0; i < n; i++) par(i) = x[i];
+  iters = info.iters;
+  error = info.error;
+
+  return static_cast<int>(status);
+}
+
+
+
+/*
+ Each nlopt function from `nloptrAPI.h` looks up its address from nloptr (using the
+ R API) the first time it's called, so this calls each of the ones used above once.
+ It stops at the first evaluation, so the objective is never used.
+ */
+double nlopt_prime_fn(unsigned n, const double* x, double* grad, void* f_data) {
+  nlopt_force_stop(*static_cast<nlopt_opt*>(f_data));
+  return 0;
+}
+
+void pglmm_nlopt_prime() {
+  nlopt_opt opt = nlopt_create(NLOPT_LN_NELDERMEAD, 1);
+  nlopt_set_min_objective(opt, nlopt_prime_fn, static_cast<void*>(&opt));
+  nlopt_set_ftol_rel(opt, 1e-8);
+  nlopt_set_ftol_abs(opt, 1e-8);
+  nlopt_set_xtol_rel(opt, 0.0001);
+  nlopt_set_maxeval(opt, 1);
+  double x = 0, value = 0;
+  nlopt_optimize(opt, &x, &value);
+  nlopt_destroy(opt);
+  return;
+}
+
+
+
+
+PglmmOptim pglmm_optimize(const pglmm_objective& fn,
+                          const arma::vec& par0,
+                          const std::string& optimizer,
+                          const int& maxit,
+                          const double& reltol,
+                          const bool& use_lbfgsb) {
+
+  PglmmOptim out;
+  out.par = par0;
+
+  try {
+    if (optimizer == "Nelder-Mead") {
+      if (use_lbfgsb) {
+        int fncount = 0, grcount = 0;
+        out.convcode = lbfgsb_optim(fn, out.par, out.value, fncount, grcount,
+                                    maxit, out.error);
+        out.counts = {static_cast<double>(fncount), static_cast<double>(grcount)};
+      } else {
+        int fncount = 0;
+        out.convcode = nelder_mead(fn, out.par, out.value, fncount, maxit,
+                                   R_NegInf, reltol);
+        if (out.convcode == NM_INIT_FAIL) {
+          out.error = "function cannot be evaluated at initial parameters";
+        }
+        out.counts = {static_cast<double>(fncount), NA_REAL};
+      }
+    } else {
+      nlopt_algorithm algorithm;
+      if (optimizer == "bobyqa") {
+        algorithm = NLOPT_LN_BOBYQA;
+      } else if (optimizer == "nelder-mead-nlopt") {
+        algorithm = NLOPT_LN_NELDERMEAD;
+      } else if (optimizer == "subplex") {
+        algorithm = NLOPT_LN_SBPLX;
+      } else {
+        out.error = "unknown optimizer \"" + optimizer + "\"";
+        return out;
+      }
+      int iters = 0;
+      out.convcode = nlopt_optim(fn, out.par, out.value, iters, algorithm,
+                                 maxit, reltol, out.error);
+      out.counts = {static_cast<double>(iters)};
+    }
+  } catch (std::exception& e) {
+    out.error = e.what();
+  }
+
+  return out;
+}
+
+
+
+PglmmOptim pglmm_optimize_parallel(const std::vector<pglmm_objective>& fns,
+                                   const arma::vec& par0,
+                                   const int& maxit,
+                                   const double& reltol) {
+
+  PglmmOptim out;
+  out.par = par0;
+
+  try {
+    int fncount = 0;
+    out.convcode = nelder_mead_parallel(fns, out.par, out.value, fncount, maxit,
+                                        R_NegInf, reltol);
+    if (out.convcode == NM_INIT_FAIL) {
+      out.error = "function cannot be evaluated at initial parameters";
+    }
+    out.counts = {static_cast<double>(fncount), NA_REAL};
+  } catch (std::exception& e) {
+    out.error = e.what();
+  }
+
+  return out;
+}
@@ -0,0 +1,617 @@
+// -*- mode: C++; c-indent-level: 4; c-basic-offset: 4; indent-tabs-mode: nil; -*-
+
+#include <RcppArmadillo.h>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+
+/*
+ Only Eigen's sparse modules (from RcppEigen) are used, and only in this file.
+ Everything outside this file uses the Armadillo interfaces in pglmm.h.
+ */
+#include <Eigen/Sparse>
+
+#include "pglmm.h"
+
+using namespace Rcpp;
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Sparse Cholesky factorizations for pglmm
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+typedef Eigen::SparseMatrix<double, Eigen::ColMajor, int> EigenSpMat;
+typedef Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, int> EigenPerm;
+typedef Eigen::SimplicialLDLT<EigenSpMat, Eigen::Upper, Eigen::NaturalOrdering<int> >
+  EigenLDLT;
+
+
+// Convert an Armadillo sparse matrix to an Eigen one
+EigenSpMat arma_to_eigen(const arma::sp_mat& A) {
+  std::vector<Eigen::Triplet<double> > trips;
+  trips.reserve(A.n_nonzero);
+  for (arma::sp_mat::const_iterator it = A.begin(); it != A.end(); ++it) {
+    trips.push_back(Eigen::Triplet<double>(it.row(), it.col(), *it));
+  }
+  EigenSpMat out(A.n_rows, A.n_cols);
+  out.setFromTriplets(trips.begin(), trips.end());
+  return out;
+}
+
+
+
+/*
+ Approximate minimum degree ordering for the pattern of nonzeros in `pattern_`.
+ `perm` stores the inverse permutation, as output from Eigen's `AMDOrdering`.
+ */
+SparseCholPattern::SparseCholPattern(const arma::sp_mat& pattern_)
+  : perm(), pattern(pattern_) {
+  EigenSpMat A = arma_to_eigen(pattern);
+  EigenPerm Pinv;
+  Eigen::AMDOrdering<int> amd;
+  amd(A, Pinv);
+  perm.assign(Pinv.indices().data(), Pinv.indices().data() + Pinv.size());
+}
+
+
+
+class SparseChol::Impl {
+public:
+  EigenPerm P;
+  EigenPerm Pinv;
+  EigenLDLT ldlt;
+  Impl() : P(), Pinv(), ldlt() {}
+};
+
+
+/*
+ Factorize `A` after permuting it using the ordering in `pattern`.
+ The symbolic analysis with a fixed ordering is only an elimination tree and
+ column counts, so it's cheap to redo here, and doing it here (rather than
+ sharing a solver) keeps these objects independent across threads.
+ Armadillo drops zeros from `A`, so the pattern is added back as explicit zeros
+ (which Eigen keeps) to give every factorization the same nonzeros.
+ */
+SparseChol::SparseChol(const arma::sp_mat& A, const SparseCholPattern& pattern,
+                       const int& n_negative)
+  : success(false), logdet(0), impl(new Impl()) {
+
+  int n = A.n_rows;
+  std::vector<Eigen::Triplet<double> > trips;
+  trips.reserve(A.n_nonzero + pattern.pattern.n_nonzero);
+  for (arma::sp_mat::const_iterator it = A.begin(); it != A.end(); ++it) {
+    trips.push_back(Eigen::Triplet<double>(it.row(), it.col(), *it));
+  }
+  if (static_cast<int>(pattern.pattern.n_rows) == n) {
+    for (arma::sp_mat::const_iterator it = pattern.pattern.begin();
+         it != pattern.pattern.end(); ++it) {
+      trips.push_back(Eigen::Triplet<double>(it.row(), it.col(), 0));
+    }
+  }
+  EigenSpMat Ae(n, n);
+  Ae.setFromTriplets(trips.begin(), trips.end());
+  EigenSpMat Ap(n, n);
+  if (static_cast<int>(pattern.perm.size()) == n) {
+    impl->Pinv.resize(n);
+    for (int i = 0; i < n; i++) impl->Pinv.indices()(i) = pattern.perm[i];
+    impl->P = impl->Pinv.inverse();
+    Ap.selfadjointView<Eigen::Upper>() =
+      Ae.selfadjointView<Eigen::Lower>().twistedBy(impl->P);
+  } else {
+    Ap = Ae.triangularView<Eigen::Upper>();
+  }
+
+  impl->ldlt.compute(Ap);
+  if (impl->ldlt.info() != Eigen::Success) return;
+  Eigen::VectorXd D = impl->ldlt.vectorD();
+  if ((D.array() == 0).any() || (D.array() < 0).count() != n_negative) return;
+
+  logdet = D.array().abs().log().sum();
+  success = true;
+}
+
+SparseChol::~SparseChol() {}
+
+
+// A^-1 * B
+arma::mat SparseChol::solve(const arma::mat& B) const {
+  Eigen::Map<const Eigen::MatrixXd> Be(B.memptr(), B.n_rows, B.n_cols);
+  Eigen::MatrixXd X;
+  if (impl->P.size() > 0) {
+    Eigen::MatrixXd PB = impl->P * Be;
+    X = impl->Pinv * impl->ldlt.solve(PB);
+  } else {
+    X = impl->ldlt.solve(Be);
+  }
+  arma::mat out(X.data(), X.rows(), X.cols());
+  return out;
+}
+
+
+/*
+ Takahashi recursion: with A = L D L' (L unit lower triangular) and Z = A^-1,
+ Z = D^-1 L^-1 + (I - L') Z, so going backward through the columns,
+   Z(j,i) = -sum_k L(k,i) Z(j,k)  for j, k in the nonzeros of column i of L,
+   Z(i,i) = 1 / D(i) - sum_k L(k,i) Z(k,i),
+ which only uses entries of Z on the (symmetric) pattern of L.
+ The cost is the sum of squared column counts of L, rather than the n^2 entries
+ of a dense inverse.
+ */
+arma::sp_mat SparseChol::inverse_subset() const {
+  const EigenSpMat& L = impl->ldlt.matrixL().nestedExpression();
+  const Eigen::VectorXd D = impl->ldlt.vectorD();
+  int n = L.rows();
+  const int* Lp = L.outerIndexPtr();
+  const int* Li = L.innerIndexPtr();
+  const double* Lx = L.valuePtr();
+
+  // Z has the same layout as L (row indices within each column are sorted)
+  std::vector<double> Zx(L.nonZeros()), Zd(n);
+  auto Z_get = [&](const int& r, const int& c) {
+    if (r == c) return Zd[r];
+    int lo = std::min(r, c), hi = std::max(r, c);
+    const int* start = Li + Lp[lo];
+    const int* end = Li + Lp[lo + 1];
+    const int* pos = std::lower_bound(start, end, hi);
+    if (pos == end || *pos != hi) {
+      throw std::runtime_error("Selected inversion needs an entry outside the factor.");
+    }
+    return Zx[pos - Li];
+  };
+
+  for (int i = n - 1; i >= 0; i--) {
+    double zii = 1 / D(i);
+    for (int p = Lp[i]; p < Lp[i + 1]; p++) {
+      double zji = 0;
+      for (int q = Lp[i]; q < Lp[i + 1]; q++) zji -= Lx[q] * Z_get(Li[p], Li[q]);
+      Zx[p] = zji;
+      zii -= Lx[p] * zji;
+    }
+    Zd[i] = zii;
+  }
+
+  // Back to the original ordering, where row i was moved to P(i)
+  std::vector<int> orig(n);
+  for (int i = 0; i < n; i++) orig[i] = (impl->P.size() > 0) ? impl->Pinv.indices()(i) : i;
+  arma::umat locations(2, n + 2 * L.nonZeros());
+  arma::vec vals(locations.n_cols);
+  unsigned k = 0;
+  for (int c = 0; c < n; c++) {
+    locations(0, k) = orig[c];
+    locations(1, k) = orig[c];
+    vals(k++) = Zd[c];
+    for (int p = Lp[c]; p < Lp[c + 1]; p++) {
+      locations(0, k) = orig[Li[p]];
+      locations(1, k) = orig[c];
+      vals(k++) = Zx[p];
+      locations(0, k) = orig[c];
+      locations(1, k) = orig[Li[p]];
+      vals(k++) = Zx[p];
+    }
+  }
+  return arma::sp_mat(locations, vals, n, n);
+}
+
+
+
+
+
+PglmmAugmented::PglmmAugmented(const List& aug)
+  : P(as<arma::sp_mat>(aug["P"])), Q(as<arma::sp_mat>(aug["Q"])), logdetQ(0),
+    cholQ() {
+  if (P.n_cols != Q.n_rows || Q.n_rows != Q.n_cols) {
+    stop("\nINTERNAL ERROR: P and Q don't match in an augmented nested term.");
+  }
+  cholQ = std::make_shared<SparseChol>(Q, SparseCholPattern(arma::spones(Q)));
+  if (!cholQ->success) stop("\nThe precision matrix of an augmented nested term isn't positive definite.");
+  logdetQ = cholQ->logdet;
+}
+
+// P Q^-1 P' * B
+arma::mat PglmmAugmented::times(const arma::mat& B) const {
+  return P * cholQ->solve(arma::mat(P.t() * B));
+}
+
+
+arma::sp_mat PglmmData::augmented_matrix(const arma::vec& a0, const arma::vec& sn) const {
+  int n = a0.n_elem;
+  int N = n + n_latent();
+  std::vector<arma::uword> rows, cols;
+  std::vector<double> vals;
+  auto add = [&](const arma::sp_mat& M, const int& r0, const int& c0, const double& w) {
+    for (arma::sp_mat::const_iterator it = M.begin(); it != M.end(); ++it) {
+      rows.push_back(r0 + it.row());
+      cols.push_back(c0 + it.col());
+      vals.push_back(w * (*it));
+    }
+  };
+  for (int i = 0; i < n; i++) {
+    rows.push_back(i);
+    cols.push_back(i);
+    vals.push_back(a0(i));
+  }
+  int offset = n;
+  for (int j = 0; j < q_Nested(); j++) {
+    if (is_augmented(j)) {
+      const PglmmAugmented& aug(augmented[j]);
+      add(aug.P, 0, offset, sn(j));
+      add(arma::sp_mat(aug.P.t()), offset, 0, sn(j));
+      add(aug.Q, offset, offset, -1);
+      offset += aug.Q.n_rows;
+    } else {
+      add(nested[j], 0, 0, sn(j) * sn(j));
+    }
+  }
+  arma::umat locations(2, rows.size());
+  for (unsigned i = 0; i < rows.size(); i++) {
+    locations(0, i) = rows[i];
+    locations(1, i) = cols[i];
+  }
+  return arma::sp_mat(true, locations, arma::vec(vals), N, N);
+}
+
+
+
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ iV in factored form
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+PglmmVinv::PglmmVinv(const arma::vec& par, const PglmmData& data, const arma::vec& a0_)
+  : logdetV(0), q_nonNested(data.q_nonNested()), n_latent(0), a0(a0_), sn(), cholA(),
+    iA_dense(),
+    kron(nullptr), kron_D(), Ut(), iA_U(), M(), M_chol(), M_chol_ok(false) {
+
+  int q_Nested = data.q_Nested();
+  if (q_Nested > 0) sn = par.subvec(q_nonNested, q_nonNested + q_Nested - 1);
+
+  // A = diag(a0) + sum of nested terms
+  double logdetA;
+  if (q_Nested > 0 && data.kron.ok && arma::all(a0 == a0(0))) {
+    kron = &data.kron;
+    kron_D = kron->eigenvalues(a0(0), sn);
+    logdetA = arma::accu(arma::log(kron_D));
+  } else if (q_Nested > 0) {
+    n_latent = data.n_latent();
+    // With augmented terms, log|A| = log|det(augmented matrix)| - log|Q|
+    cholA = std::make_shared<SparseChol>(data.augmented_matrix(a0, sn),
+                                         data.chol_pattern, n_latent);
+    if (cholA->success) {
+      logdetA = cholA->logdet - data.logdetQ();
+    } else {
+      // Fall back to a dense inverse if the sparse factorization fails:
+      cholA.reset();
+      n_latent = 0;
+      arma::mat A1 = arma::diagmat(a0);
+      for (int j = 0; j < q_Nested; j++) A1 += (sn(j) * sn(j)) * data.nested_dense(j);
+      iA_dense = arma::inv(A1);
+      double sign;
+      arma::log_det(logdetA, sign, A1);
+    }
+  } else {
+    logdetA = arma::accu(arma::log(a0));
+  }
+
+  // Woodbury and Sylvester identities for the non-nested terms
+  double logdetM = 0;
+  if (q_nonNested > 0) {
+    arma::rowvec sr = par.subvec(0, q_nonNested - 1).t();
+    arma::vec iC1 = arma::vectorise(arma::mat(sr * data.St), 0);
+    arma::sp_mat iC(iC1.n_elem, iC1.n_elem);
+    iC.diag() = iC1;
+    Ut = iC * data.Zt;
+    iA_U = iA_times(arma::mat(Ut.t()));
+    M = arma::mat(Ut * iA_U);
+    M.diag() += 1;
+    M_chol_ok = arma::chol(M_chol, M);
+    if (M_chol_ok) {
+      logdetM = 2 * arma::accu(arma::log(M_chol.diag()));
+    } else {
+      double sign;
+      arma::log_det(logdetM, sign, M);
+    }
+  }
+
+  logdetV = logdetA + logdetM;
+}
+
+
+// iA * B
+arma::mat PglmmVinv::iA_times(const arma::mat& B) const {
+  if (kron) return kron->solve(kron_D, B);
+  if (cholA && n_latent > 0) {
+    // The latent variables' part of the right-hand side is zero
+    arma::mat B_aug = arma::join_cols(B, arma::mat(n_latent, B.n_cols, arma::fill::zeros));
+    return cholA->solve(B_aug).head_rows(B.n_rows);
+  }
+  if (cholA) return cholA->solve(B);
+  if (iA_dense.n_elem > 0) return iA_dense * B;
+  arma::mat out = B;
+  out.each_col() /= a0;
+  return out;
+}
+
+// M^-1 * B
+arma::mat PglmmVinv::M_solve(const arma::mat& B) const {
+  if (M_chol_ok) {
+    return arma::solve(arma::trimatu(M_chol), arma::solve(arma::trimatl(M_chol.t()), B));
+  }
+  return arma::solve(M, B);
+}
+
+// iV * B
+arma::mat PglmmVinv::times(const arma::mat& B) const {
+  arma::mat iA_B = iA_times(B);
+  if (q_nonNested == 0) return iA_B;
+  return iA_B - iA_U * M_solve(Ut * iA_B);
+}
+
+/*
+ Diagonal of iV, without forming iV.
+ With nested terms, diag(iA) comes from the eigenvalues with Kronecker structure,
+ or from selected inversion of the sparse factor of A.
+ */
+arma::vec PglmmVinv::diag() const {
+  arma::vec d;
+  if (kron) {
+    // iA = K diag(1 / D) K' with K = kronecker(Q_site, Q_sp)
+    arma::mat G = arma::square(kron->Q_sp) * (1 / kron_D) * arma::square(kron->Q_site).t();
+    arma::vec g = arma::vectorise(G);
+    d = g.elem(kron->index);
+  } else if (cholA) {
+    arma::sp_mat Z = cholA->inverse_subset();
+    d = arma::vec(Z.diag()).head(a0.n_elem);
+  } else if (iA_dense.n_elem > 0) {
+    d = iA_dense.diag();
+  } else {
+    d = 1 / a0;
+  }
+  if (q_nonNested == 0) return d;
+  arma::mat W = M_solve(iA_U.t());
+  d -= arma::sum(iA_U % W.t(), 1);
+  return d;
+}
+
+
+/*
+ tr(iV N_j) for each nested term j, without forming iV.
+ tr(iA N_j) uses the same sources as `diag()`. For an augmented term with
+ latent block j of the inverse of [A0, sn P; sn P', -Q] equal to Z_jj,
+ tr(iA N_j) = (m_j + tr(Q_j Z_jj)) / sn_j^2, where m_j is the number of latent
+ variables; the two parts cancel as sn_j goes to zero, so small variances use
+ tr(iA N_j) directly, a block of columns at a time.
+ The non-nested terms then subtract tr(M^-1 U' iA N_j iA U) (Woodbury).
+ */
+arma::vec PglmmVinv::trace_nested(const PglmmData& data) const {
+  int q_Nested = data.q_Nested();
+  int n = a0.n_elem;
+  arma::vec tr(q_Nested, arma::fill::zeros);
+
+  auto trace_columns = [&](const int& j) {
+    double t = 0;
+    int block = 64;
+    for (int c0 = 0; c0 < n; c0 += block) {
+      int c1 = std::min(n, c0 + block) - 1;
+      arma::mat E(n, c1 - c0 + 1, arma::fill::zeros);
+      for (int c = c0; c <= c1; c++) E(c, c - c0) = 1;
+      t += arma::accu(E % iA_times(data.nested_times(j, E)));
+    }
+    return t;
+  };
+
+  if (kron) {
+    for (int j = 0; j < q_Nested; j++) {
+      tr(j) = arma::accu((kron->lambda_sp[j] * kron->lambda_site[j].t()) / kron_D);
+    }
+  } else if (cholA) {
+    arma::sp_mat Z = cholA->inverse_subset();
+    int offset = n;
+    for (int j = 0; j < q_Nested; j++) {
+      if (data.is_augmented(j)) {
+        const PglmmAugmented& aug(data.augmented[j]);
+        int m = aug.Q.n_rows;
+        double s2 = sn(j) * sn(j);
+        if (s2 > 1e-6) {
+          arma::sp_mat Zjj = Z.submat(offset, offset, offset + m - 1, offset + m - 1);
+          tr(j) = (m + arma::accu(aug.Q % Zjj)) / s2;
+        } else {
+          tr(j) = trace_columns(j);
+        }
+        offset += m;
+      } else {
+        tr(j) = arma::accu(data.nested[j] % Z.submat(0, 0, n - 1, n - 1));
+      }
+    }
+  } else {
+    for (int j = 0; j < q_Nested; j++) {
+      if (iA_dense.n_elem > 0 && !data.is_augmented(j)) {
+        tr(j) = arma::accu(data.nested[j] % iA_dense);
+      } else {
+        tr(j) = trace_columns(j);
+      }
+    }
+  }
+
+  if (q_nonNested > 0) {
+    for (int j = 0; j < q_Nested; j++) {
+      tr(j) -= arma::trace(M_solve(iA_U.t() * data.nested_times(j, iA_U)));
+    }
+  }
+  return tr;
+}
+
+
+
+
+/*
+ With Ut = D Zt, Woodbury gives, for example,
+ X' iV X = X' iA X - (D Zt iA X)' M^-1 (D Zt iA X), where M = I + D (Zt iA Zt') D.
+ With Kronecker structure (and no non-nested terms), V = Q diag(e) Q', so
+ X' iV X = (Q' X)' diag(1 / e) (Q' X), which costs O(n p^2) per evaluation.
+ */
+void pglmm_gram_forms(const arma::vec& par, const PglmmData& data,
+                      arma::mat& XiVX, arma::vec& XiVy, double& yiVy,
+                      double& logdetV) {
+
+  const PglmmGram& g(data.gram);
+  int p = g.XX.n_rows;
+  int q_nonNested = data.q_nonNested();
+
+  if (q_nonNested == 0) {
+    arma::vec e = arma::vectorise(data.kron.eigenvalues(1 / g.w(0), par));
+    arma::mat eKX = g.KX;
+    eKX.each_col() /= e;
+    XiVX = g.KX.t() * eKX;
+    XiVy = eKX.t() * g.Ky;
+    yiVy = arma::dot(g.Ky, g.Ky / e);
+    logdetV = arma::accu(arma::log(e));
+    return;
+  }
+
+  arma::rowvec sr = par.subvec(0, q_nonNested - 1).t();
+  arma::vec d = arma::vectorise(arma::mat(sr * data.St), 0);
+
+  arma::mat M = g.ZZ % (d * d.t());
+  M.diag() += 1;
+
+  arma::mat DZXy = arma::join_rows(g.ZX, g.Zy);
+  DZXy.each_col() %= d;
+
+  arma::mat R, S;
+  double logdetM;
+  if (arma::chol(R, M)) {
+    S = arma::solve(arma::trimatu(R), arma::solve(arma::trimatl(R.t()), DZXy));
+    logdetM = 2 * arma::accu(arma::log(R.diag()));
+  } else {
+    S = arma::solve(M, DZXy);
+    double sign;
+    arma::log_det(logdetM, sign, M);
+  }
+
+  arma::mat K = DZXy.t() * S;
+  XiVX = g.XX - K.submat(0, 0, p - 1, p - 1);
+  XiVy = g.Xy - K.submat(0, p, p - 1, p);
+  yiVy = g.yy - K(p, p);
+  logdetV = g.logdetA + logdetM;
+
+  return;
+}
+
+
+
+
+
+/*
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+
+ Kronecker structure on a site x species grid
+
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ ***************************************************************************************
+ */
+
+/*
+ Eigenvalues of each matrix in `mats` in a shared basis `Q`, from the first
+ non-identity (non-empty) matrix.
+ Returns false if some matrix isn't diagonal in that basis.
+ */
+bool shared_eigen(const List& mats, const int& dim, arma::mat& Q,
+                  std::vector<arma::vec>& lambdas) {
+  int q = mats.size();
+  lambdas.resize(q);
+  Q = arma::eye<arma::mat>(dim, dim);
+  bool has_Q = false;
+  for (int j = 0; j < q; j++) {
+    arma::mat Sj = as<arma::mat>(mats[j]);
+    if (Sj.n_elem == 0) {
+      lambdas[j] = arma::vec(dim, arma::fill::ones);
+      continue;
+    }
+    if (static_cast<int>(Sj.n_rows) != dim || static_cast<int>(Sj.n_cols) != dim) {
+      return false;
+    }
+    if (!has_Q) {
+      arma::vec eigval;
+      if (!arma::eig_sym(eigval, Q, Sj)) return false;
+      has_Q = true;
+    }
+    arma::mat QSQ = Q.t() * Sj * Q;
+    lambdas[j] = QSQ.diag();
+    QSQ.diag().zeros();
+    if (arma::abs(QSQ).max() > 1e-8 * arma::abs(lambdas[j]).max()) return false;
+  }
+  return true;
+}
+
+
+PglmmKron::PglmmKron(const List& kron)
+  : ok(false), index(), n_site(0), n_sp(0), Q_site(), Q_sp(),
+    lambda_site(), lambda_sp() {
+
+  n_site = as<int>(kron["n_site"]);
+  n_sp = as<int>(kron["n_sp"]);
+  IntegerVector index_ = kron["index"];
+  index = arma::uvec(index_.size());
+  for (int i = 0; i < index_.size(); i++) index(i) = index_[i] - 1;
+
+  if (!shared_eigen(as<List>(kron["site"]), n_site, Q_site, lambda_site)) return;
+  if (!shared_eigen(as<List>(kron["sp"]), n_sp, Q_sp, lambda_sp)) return;
+
+  ok = true;
+}
+
+
+/*
+ kronecker(S, P) * vec(G) = vec(P * G * S'), where G is n_sp x n_site in grid order.
+ */
+arma::mat PglmmKron::rotate(const arma::mat& B) const {
+  arma::mat out(n_sp * n_site, B.n_cols);
+  arma::vec g(n_sp * n_site);
+  for (unsigned c = 0; c < B.n_cols; c++) {
+    g.elem(index) = B.col(c);
+    arma::mat G(g.memptr(), n_sp, n_site, false, true);
+    out.col(c) = arma::vectorise(Q_sp.t() * G * Q_site);
+  }
+  return out;
+}
+
+arma::mat PglmmKron::solve(const arma::mat& D, const arma::mat& B) const {
+  arma::mat out(B.n_rows, B.n_cols);
+  arma::vec g(B.n_rows);
+  for (unsigned c = 0; c < B.n_cols; c++) {
+    g.elem(index) = B.col(c);
+    // `G` uses the memory in `g`
+    arma::mat G(g.memptr(), n_sp, n_site, false, true);
+    arma::mat T = (Q_sp.t() * G * Q_site) / D;
+    G = Q_sp * T * Q_site.t();
+    out.col(c) = g.elem(index);
+  }
+  return out;
+}